@@ -0,0 +1,7 @@
+datatype=$1
+for index in 1 2 3 4 5; do
+	for precision in double float bf16; do
+		echo -n "${datatype} fold ${index} precision ${precision}: "
+		./bin/basketrec -test ../cross_validation/test/${datatype}_test_seq_${index}.txt -train ../cross_validation/train/${datatype}_train_seq_${index}.txt -method fpmc -iter 10 -num_sample 30 -seed 1 -precision ${precision} | grep "best MRR" | tail -1
+	done
+done
@@ -0,0 +1,8 @@
+datatype=$1
+target_mrr=$2
+for index in 1 2 3 4 5; do
+	for sampler in uniform pop adaptive; do
+		echo -n "${datatype} fold ${index} sampler ${sampler}: "
+		./bin/basketrec -test ../cross_validation/test/${datatype}_test_seq_${index}.txt -train ../cross_validation/train/${datatype}_train_seq_${index}.txt -method fpmc -sampler ${sampler} -target_mrr ${target_mrr} | grep "Target MRR"
+	done
+done
@@ -0,0 +1,8 @@
+datatype=$1
+max_threads=${2:-$(nproc)}
+for index in 1 2 3 4 5; do
+	for threads in $(seq 1 ${max_threads}); do
+		echo -n "${datatype} fold ${index} threads ${threads}: "
+		./bin/basketrec -test ../cross_validation/test/${datatype}_test_seq_${index}.txt -train ../cross_validation/train/${datatype}_train_seq_${index}.txt -method fpmc -iter 1 -threads ${threads} | grep -o "Samples/s: [0-9.e+]*"
+	done
+done
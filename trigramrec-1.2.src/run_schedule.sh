@@ -0,0 +1,8 @@
+datatype=$1
+iter=$2
+for index in 1 2 3 4 5; do
+	for schedule in uniform blocked; do
+		echo "${datatype} fold ${index} schedule ${schedule}: "
+		./bin/basketrec -test ../cross_validation/test/${datatype}_test_seq_${index}.txt -train ../cross_validation/train/${datatype}_train_seq_${index}.txt -method fpmc -iter ${iter} -schedule ${schedule} | grep -E "^Time|best MRR" | paste - -
+	done
+done
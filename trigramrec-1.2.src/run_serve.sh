@@ -0,0 +1,5 @@
+index=$1
+datatype=$2
+model=$3
+# client stand-in: turns the test rows into "user_id item_1 ... item_k" requests
+awk '{ printf "%s", $1; for (i = 4; i < NF; i++) printf " %s", $i; print "" }' ../cross_validation/test/${datatype}_test_seq_${index}.txt | ./bin/basketrec -mode serve -load_model ${model} > /dev/null
@@ -0,0 +1,19 @@
+datatype=$1
+index=$2
+update_index=$3
+dir=$(mktemp -d)
+trap 'rm -rf ${dir}' EXIT
+# base model, then -mode update on the rows of another fold without -test
+./bin/basketrec -test ../cross_validation/test/${datatype}_test_seq_${index}.txt -train ../cross_validation/train/${datatype}_train_seq_${index}.txt -method fpmc -iter 2 -seed 1 -save_model ${dir}/base.bin > /dev/null || exit 1
+./bin/basketrec -mode update -load_model ${dir}/base.bin -train ../cross_validation/train/${datatype}_train_seq_${update_index}.txt -method fpmc -iter 1 -seed 1 -save_model ${dir}/update_1.bin > /dev/null || exit 1
+./bin/basketrec -mode update -load_model ${dir}/base.bin -train ../cross_validation/train/${datatype}_train_seq_${update_index}.txt -method fpmc -iter 3 -seed 1 -save_model ${dir}/update_3.bin > ${dir}/update_3.log || exit 1
+# the update must keep its last iteration: no evaluation on the missing test data, no restored snapshot
+if grep -q "Restored the model" ${dir}/update_3.log || ! grep -q "no test data" ${dir}/update_3.log; then
+	echo "FAIL: the update without -test evaluated or restored a snapshot"
+	exit 1
+fi
+if cmp -s ${dir}/update_1.bin ${dir}/update_3.bin; then
+	echo "FAIL: the model of a 3 iteration update equals the one after iteration 0"
+	exit 1
+fi
+echo "OK: ${datatype} update of fold ${index} with the rows of fold ${update_index} keeps its last iteration"
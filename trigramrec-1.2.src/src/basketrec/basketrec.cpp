@@ -14,35 +14,266 @@
 #include <iterator>
 #include <algorithm>
 #include <iomanip>
+#include <sstream>
+#include <atomic>
 #include "../util/util.h"
 #include "../util/cmdline.h"
 
 #include "src/Data.h"
 #include "src/basket_rec_fpmc.h"
+#include "src/PredictionServer.h"
+#include "src/HyperparameterSearch.h"
 
 
 using namespace std;
 
+// the FPMC hyperparameters of the command line; read once on the main thread, since CMDLine
+// is not safe for concurrent use and the folds of -cv and the trials of -mode search create
+// their models on pool threads
+struct FPMCOptions {
+	bool interleaved_layout;
+	bool huge_pages;
+	double learn_rate;
+	int num_neg_samples;
+	int num_iterations;
+	std::string sampler;
+	double sampler_lambda;
+	double target_mrr;
+	int eval_every, eval_sample, patience;
+	bool keep_best;
+	std::string schedule;
+	int schedule_block, schedule_negatives;
+	bool mean_transition;
+	int history;
+	double init_stdev;
+	int num_feature;
+	double regular_UI, regular_IU, regular_IL, regular_LI, regular_MI, regular_IM;
+	int num_threads;
+};
+
+FPMCOptions readFPMCOptions(CMDLine& cmdline) {
+	FPMCOptions options;
+	const std::string layout = cmdline.getValue("layout", std::string("interleaved"));
+	if (layout.compare("interleaved") && layout.compare("rows")) {
+		throw "unknown layout " + layout;
+	}
+	options.interleaved_layout = ! layout.compare("interleaved");
+	options.huge_pages = cmdline.hasParameter("huge_pages");
+
+	options.learn_rate = cmdline.getValue("learn_rate", 0.01);
+	options.num_neg_samples = cmdline.getValue("num_sample", 100);
+	options.num_iterations = cmdline.getValue("iter", 100);
+	options.sampler = cmdline.getValue("sampler", std::string("uniform"));
+	options.sampler_lambda = cmdline.getValue("sampler_lambda", 0.1);
+	options.target_mrr = cmdline.getValue("target_mrr", 0.0);
+	// the training options default to the learner's defaults
+	BasketLearnerBPR defaults;
+	options.eval_every = cmdline.getValue("eval_every", defaults.eval_every);
+	options.eval_sample = cmdline.getValue("eval_sample", defaults.eval_sample);
+	options.patience = cmdline.getValue("patience", defaults.patience);
+	options.keep_best = (cmdline.getValue("keep_best", defaults.keep_best ? 1 : 0) != 0);
+	options.schedule = cmdline.getValue("schedule", defaults.schedule);
+	options.schedule_block = cmdline.getValue("schedule_block", defaults.schedule_block);
+	options.schedule_negatives = cmdline.getValue("schedule_negatives", defaults.schedule_negatives);
+	const std::string transition = cmdline.getValue("transition", std::string("position"));
+	if (transition.compare("position") && transition.compare("mean")) {
+		throw "unknown transition " + transition;
+	}
+	options.mean_transition = ! transition.compare("mean");
+	options.history = cmdline.getValue("history", 2);
+
+	options.init_stdev = cmdline.getValue("init_stdev", 0.01);
+	options.num_feature = cmdline.getValue("dim", 64);
+	options.regular_UI = cmdline.getValue("regular_UI", 0.01);
+	options.regular_IU = cmdline.getValue("regular_IU", 0.01);
+	options.regular_IL = cmdline.getValue("regular_IL", 0.01);
+	options.regular_LI = cmdline.getValue("regular_LI", 0.01);
+	options.regular_MI = cmdline.getValue("regular_MI", 0.01);
+	options.regular_IM = cmdline.getValue("regular_IM", 0.01);
+	options.num_threads = cmdline.getValue("threads", 1);
+	return options;
+}
+
+// FPMC with the given hyperparameters, sized for the users and items of dataset; init() is left to the caller
+NextBasketRecommenderFPMC* createFPMC(const FPMCOptions& options, const std::string& precision, const Dataset& dataset) {
+	NextBasketRecommenderFPMC *fpmc = NextBasketRecommenderFPMC::create(precision);
+	fpmc->interleaved_layout = options.interleaved_layout;
+	fpmc->huge_pages = options.huge_pages;
+
+	fpmc->loss_function = LOSS_FUNCTION_LN_SIGMOID;
+	fpmc->learn_rate = options.learn_rate;
+	fpmc->num_neg_samples = options.num_neg_samples;
+	fpmc->num_iterations = options.num_iterations;
+	fpmc->sampler = options.sampler;
+	fpmc->sampler_lambda = options.sampler_lambda;
+	fpmc->target_mrr = options.target_mrr;
+	fpmc->eval_every = options.eval_every;
+	fpmc->eval_sample = options.eval_sample;
+	fpmc->patience = options.patience;
+	fpmc->keep_best = options.keep_best;
+	fpmc->schedule = options.schedule;
+	fpmc->schedule_block = options.schedule_block;
+	fpmc->schedule_negatives = options.schedule_negatives;
+	fpmc->mean_transition = options.mean_transition;
+	fpmc->history = options.history;
+
+	fpmc->num_user = dataset.max_user_id+1;
+	fpmc->num_item = dataset.max_item_id+1;
+	if (dataset.remap_ids) {
+		fpmc->user_ids = dataset.users;
+		fpmc->item_ids = dataset.items;
+	}
+
+	fpmc->init_mean = 0;
+	fpmc->init_stdev = options.init_stdev;
+
+	fpmc->num_feature = options.num_feature;
+	fpmc->regular_UI = options.regular_UI;
+	fpmc->regular_IU = options.regular_IU;
+	fpmc->regular_IL = options.regular_IL;
+	fpmc->regular_LI = options.regular_LI;
+
+	fpmc->regular_MI = options.regular_MI;
+	fpmc->regular_IM = options.regular_IM;
+	fpmc->num_threads = options.num_threads;
+	return fpmc;
+}
+
+// -cv: trains the folds <cv_dir>/train/<data>_train_seq_<i>.txt (tested on .../test/<data>_test_seq_<i>.txt)
+// of every -cv_data and -cv index concurrently and reports the MRR per fold with mean and stdev
+void runCrossValidation(CMDLine& cmdline) {
+	std::vector<std::string> datatypes = cmdline.hasParameter("cv_data") ? cmdline.getStrValues("cv_data") : std::vector<std::string>(1, "android");
+	std::vector<int> indices = cmdline.getIntValues("cv");
+	const std::string cv_dir = cmdline.getValue("cv_dir", std::string("../cross_validation"));
+	const std::string precision = cmdline.getValue("precision", std::string("double"));
+	const FPMCOptions options = readFPMCOptions(cmdline);
+	const bool remap_ids = cmdline.hasParameter("remap_ids");
+	const bool use_cache = cmdline.hasParameter("data_cache");
+	std::vector<std::string> fold_name, train_file, test_file;
+	for (uint d = 0; d < datatypes.size(); d++) {
+		for (uint i = 0; i < indices.size(); i++) {
+			std::ostringstream name, suffix;
+			name << datatypes[d] << "_" << indices[i];
+			suffix << "_seq_" << indices[i] << ".txt";
+			fold_name.push_back(name.str());
+			train_file.push_back(cv_dir + "/train/" + datatypes[d] + "_train" + suffix.str());
+			test_file.push_back(cv_dir + "/test/" + datatypes[d] + "_test" + suffix.str());
+		}
+	}
+	int num_folds = fold_name.size();
+	if (num_folds == 0) {
+		throw std::string("-cv needs a list of fold indices, e.g. -cv 1,2,3,4,5");
+	}
+	// the folds run concurrently; threads left over are split among the folds for their SGD and evaluation
+	int num_threads = cmdline.getValue("threads", 1);
+	int num_concurrent = std::min(std::max(num_threads, 1), num_folds);
+	int fold_threads = std::max(1, num_threads / num_concurrent);
+	std::cout << "Cross validation: " << num_folds << " folds, " << num_concurrent << " at a time with " << fold_threads << " thread(s) each" << std::endl;
+
+	// every fold draws from its own seed, so the results do not depend on the schedule
+	std::vector<uint64_t> fold_seed(num_folds);
+	for (int f = 0; f < num_folds; f++) {
+		fold_seed[f] = ran_global().next();
+	}
+	std::vector<Dataset*> dataset(num_folds, (Dataset*) NULL);
+	std::vector<double> mrr(num_folds, 0.0), train_time(num_folds, 0.0);
+	ThreadPool pool(num_concurrent);
+	std::atomic<int> next_fold;
+
+	// the per-fold progress of the concurrent jobs would interleave; the report follows below
+	double total_time = getwalltime();
+	std::cout.setstate(std::ios::badbit);
+	try {
+		next_fold = 0;
+		pool.run([&](int thread_id) {
+			for (int f = next_fold++; f < num_folds; f = next_fold++) {
+				IdDictionary no_ids;
+				const IdDictionary* ids = remap_ids ? &no_ids : NULL;
+				dataset[f] = new Dataset(train_file[f], use_cache, fold_threads, ids, ids);
+				dataset[f]->loadTestSplit(test_file[f]);
+			}
+		});
+		next_fold = 0;
+		pool.run([&](int thread_id) {
+			for (int f = next_fold++; f < num_folds; f = next_fold++) {
+				ran_seed(fold_seed[f]);
+				double fold_time = getwalltime();
+				NextBasketRecommenderFPMC* fpmc = createFPMC(options, precision, *dataset[f]);
+				fpmc->num_threads = fold_threads;
+				fpmc->init();
+				fpmc->N = 10;
+				mrr[f] = fpmc->train(*dataset[f]);
+				train_time[f] = getwalltime() - fold_time;
+				delete fpmc;
+				delete dataset[f];
+				dataset[f] = NULL;
+			}
+		});
+	} catch (...) {
+		std::cout.clear();
+		for (int f = 0; f < num_folds; f++) {
+			delete dataset[f];
+		}
+		throw;
+	}
+	std::cout.clear();
+	total_time = getwalltime() - total_time;
+
+	double sum = 0, sum_sq = 0;
+	std::cout << "fold\tMRR\ttime" << std::endl;
+	for (int f = 0; f < num_folds; f++) {
+		std::cout << fold_name[f] << "\t" << mrr[f] << "\t" << train_time[f] << std::endl;
+		sum += mrr[f];
+		sum_sq += mrr[f] * mrr[f];
+	}
+	double mean = sum / num_folds;
+	double stdev = (num_folds > 1) ? sqrt(std::max(0.0, (sum_sq - num_folds * mean * mean) / (num_folds - 1))) : 0.0;
+	std::cout << "MRR mean: " << mean << " stdev: " << stdev << " (" << num_folds << " folds, " << total_time << " s)" << std::endl;
+	if (cmdline.hasParameter("mrr_out")) {
+		std::ofstream out_file (cmdline.getValue("mrr_out").c_str());
+		if (! out_file.is_open()) {
+			throw "Unable to open file " + cmdline.getValue("mrr_out");
+		}
+		for (int f = 0; f < num_folds; f++) {
+			out_file << fold_name[f] << "\t" << mrr[f] << std::endl;
+		}
+		out_file << "mean\t" << mean << std::endl;
+		out_file << "stdev\t" << stdev << std::endl;
+	}
+}
+
 int main(int argc, char **argv) { 
  	
- 	srand ( time(NULL) );
 	try {
 		CMDLine cmdline(argc, argv);
-		std::cout << "Facotorizing Personalized Markov Chains (FPMC)" << std::endl;
-		std::cout << "  Version: 1.0" << std::endl;
-		std::cout << "  Author:  Tanya Wang, r03922032@ntu.edu.tw" << std::endl;
-		std::cout << "  License: Free for academic use. See license.txt." << std::endl;
-		std::cout << "  Modified from Tag Recommender source codes by Steffen Rendle" << std::endl;
-		std::cout << "----------------------------------------------------------------------------" << std::endl;
+		// in serve mode stdout carries the responses
+		std::ostream& banner_out = (cmdline.hasParameter("mode") && ! cmdline.getValue("mode").compare("serve")) ? std::cerr : std::cout;
+		banner_out << "Facotorizing Personalized Markov Chains (FPMC)" << std::endl;
+		banner_out << "  Version: 1.0" << std::endl;
+		banner_out << "  Author:  Tanya Wang, r03922032@ntu.edu.tw" << std::endl;
+		banner_out << "  License: Free for academic use. See license.txt." << std::endl;
+		banner_out << "  Modified from Tag Recommender source codes by Steffen Rendle" << std::endl;
+		banner_out << "----------------------------------------------------------------------------" << std::endl;
 
 		const std::string param_train_file	= cmdline.registerParameter("train", "filename for training data [MANDATORY]");
 		const std::string param_test_file	= cmdline.registerParameter("test", "filename for test data [MANDATORY]");
 		const std::string param_out		= cmdline.registerParameter("out", "filename for output; default=''");
+		const std::string param_out_format	= cmdline.registerParameter("out_format", "format of -out: 'text' (lines 'user time item score') or 'binary' (fixed-size top-N records, see TopNFileHeader); default=text");
 		const std::string param_mrr_out		= cmdline.registerParameter("mrr_out", "filename for bst mrr output; default=''");
+		const std::string param_log		= cmdline.registerParameter("log", "filename for telemetry: one line per phase (load, case_build, init, sgd, evaluate, save_model, save_prediction) with wall/CPU time, samples/sec, estimated BPR loss, MRR and peak RSS; JSON lines if the name ends in .json, else TSV; default=''");
+		const std::string param_save_model	= cmdline.registerParameter("save_model", "filename for writing the trained model (binary); default=''");
+		const std::string param_load_model	= cmdline.registerParameter("load_model", "filename of a binary model to use instead of training; default=''");
 
+		const std::string param_data_cache	= cmdline.registerParameter("data_cache", "keep a binary copy <file>.cache of every data file and map it instead of parsing the text when it is up to date");
+		const std::string param_remap_ids	= cmdline.registerParameter("remap_ids", "read user and item ids as raw ids (numbers or strings) and map them to dense ids, items by descending frequency in the training data; -out and -save_model keep the raw ids, a -load_model model trained this way brings its mapping (implied); no -data_cache");
 		const std::string param_num_pred_out	= cmdline.registerParameter("num_out", "how many recommended items per (user,time,basket) should be written; default=10");
 
+		const std::string param_mode		= cmdline.registerParameter("mode", "'train' (train, evaluate and predict the test file), 'update' (continue training a -load_model model on the new rows of -train, adding unseen users and items) 'serve' (answer 'user_id item_1 ... item_k' lines from stdin with the top items of a -load_model model) or 'search' (hyperparameter search, see -search); default=train");
+		const std::string param_batch_size	= cmdline.registerParameter("batch_size", "serve: maximal number of queued requests scored together; default=64");
 		const std::string param_method		= cmdline.registerParameter("method", "method: 'fpmc' [MANDATORY]");
+		const std::string param_precision	= cmdline.registerParameter("precision", "storage of the factors: 'double', 'float' or 'bf16' (bfloat16 storage, float arithmetic); a -load_model model keeps its own; default=double");
+		const std::string param_layout		= cmdline.registerParameter("layout", "memory layout of new factors: 'interleaved' (IU, IL and IM of an item in one cache-aligned row) or 'rows' (one matrix per factor); default=interleaved");
+		const std::string param_huge_pages	= cmdline.registerParameter("huge_pages", "allocate the interleaved factors on transparent huge pages");
 		const std::string param_dim		= cmdline.registerParameter("dim", "dim of factorization; default=64");
 		const std::string param_regular_UI		= cmdline.registerParameter("regular_UI", "regularization; default=0.01");
 		const std::string param_regular_IU		= cmdline.registerParameter("regular_IU", "regularization; default=0.01");
@@ -52,10 +283,38 @@ int main(int argc, char **argv) {
 		const std::string param_regular_MI		= cmdline.registerParameter("regular_MI", "regularization; default=0.01");
 		const std::string param_regular_IM		= cmdline.registerParameter("regular_IM", "regularization; default=0.01");
 
+		const std::string param_transition	= cmdline.registerParameter("transition", "transition factors of the history items: 'position' (the last item through LI/IL, the mean of the older ones through MI/IM) or 'mean' (the mean of all of them through LI/IL); a -load_model model keeps its own; default=position");
+		const std::string param_history		= cmdline.registerParameter("history", "number of most recent history items of the transition part, 0 = the whole history; default=2 (with -transition position the FPMC of the last two items)");
 		const std::string param_init_stdev	= cmdline.registerParameter("init_stdev", "stdev for initialization of 2-way factors; default=0.01");			
-		const std::string param_num_iter	= cmdline.registerParameter("iter", "number of iterations for SGD; default=100");
+		const std::string param_num_iter	= cmdline.registerParameter("iter", "number of iterations for SGD; default=100 (10 for -mode update)");
 		const std::string param_learn_rate	= cmdline.registerParameter("learn_rate", "learn_rate for SGD; default=0.01");
 		const std::string param_num_sample      = cmdline.registerParameter("num_sample", "number of the pair samples drawn for each training tuple, default 100");
+		const std::string param_sampler		= cmdline.registerParameter("sampler", "negative item sampler: 'uniform', 'pop' (proportional to item popularity) or 'adaptive' (items ranked high by the current model); default=uniform");
+		const std::string param_sampler_lambda	= cmdline.registerParameter("sampler_lambda", "adaptive sampler: mean rank of the drawn negatives relative to the number of items; default=0.1");
+		const std::string param_target_mrr	= cmdline.registerParameter("target_mrr", "stop training once the test MRR reaches this value and report the training time needed; default=off");
+		const std::string param_eval_every	= cmdline.registerParameter("eval_every", "evaluate on the test data after every K-th iteration; default=1");
+		const std::string param_eval_sample	= cmdline.registerParameter("eval_sample", "rank each test case against M sampled items instead of all items during training (the final model gets a full evaluation); default=0 (all items)");
+		const std::string param_patience	= cmdline.registerParameter("patience", "stop training after this many evaluations without a better MRR; default=0 (off)");
+		const std::string param_keep_best	= cmdline.registerParameter("keep_best", "1: keep a copy of the best evaluated model in memory and use it for -out/-save_model after training, 0: use the last iteration; default=1");
+		const std::string param_schedule	= cmdline.registerParameter("schedule", "order of the SGD steps: 'uniform' (cases drawn with replacement) or 'blocked' (each iteration visits blocks of cases with the same user and last item in shuffled order and draws -schedule_negatives negatives per case and visit while the factors of the block are in cache, until every case has -num_sample negatives); default=uniform");
+		const std::string param_schedule_block	= cmdline.registerParameter("schedule_block", "number of cases per block of -schedule blocked; default=32");
+		const std::string param_schedule_negatives	= cmdline.registerParameter("schedule_negatives", "negatives per case and block visit of -schedule blocked; default=10");
+		const std::string param_threads		= cmdline.registerParameter("threads", "number of worker threads for parsing, lock-free SGD and evaluation; default=1");
+		const std::string param_processes	= cmdline.registerParameter("processes", "train with P processes of -threads threads each: the factors are in shared memory, each process trains on its own shard of the training cases, the first one evaluates after each iteration; needs a new model (no -load_model) and -layout interleaved; default=1");
+		const std::string param_seed		= cmdline.registerParameter("seed", "seed of the random number generator; with -threads 1 a run is reproducible; default=current time");
+
+		const std::string param_mips_clusters	= cmdline.registerParameter("mips_clusters", "build an approximate top-N index with this many clusters after training and use it for -out; default=off");
+		const std::string param_mips_probe	= cmdline.registerParameter("mips_probe", "number of index clusters scanned per query; default=8");
+
+		const std::string param_search		= cmdline.registerParameter("search", "-mode search: 'grid' (all combinations of -search_space), 'random' (-search_trials random configurations), 'halving' (successive halving of -search_trials random configurations from -search_min_iter up to -iter iterations) or 'hyperband'; default=halving");
+		const std::string param_search_space	= cmdline.registerParameter("search_space", "-mode search: parameters and their values, e.g. 'dim=16|32|64;learn_rate=0.001..0.1;regular=0.001|0.01|0.1' (a..b: log-uniform range, regular: all regular_*); supports dim, learn_rate, init_stdev, num_sample, regular and regular_*");
+		const std::string param_search_trials	= cmdline.registerParameter("search_trials", "-mode search: number of random configurations; default=27");
+		const std::string param_search_min_iter	= cmdline.registerParameter("search_min_iter", "-mode search: iterations of the first halving round; default=4");
+		const std::string param_search_eta	= cmdline.registerParameter("search_eta", "-mode search: each halving round keeps the best 1/eta configurations and trains them eta times as long; default=3");
+		const std::string param_search_out	= cmdline.registerParameter("search_out", "-mode search: filename for the table of all trials; the best model goes to -save_model and -out");
+		const std::string param_cv		= cmdline.registerParameter("cv", "cross validation: train and evaluate these folds (e.g. 1,2,3,4,5) in one process, -threads of them at a time, and report the MRR per fold with mean and stdev (-mrr_out writes them); replaces -train/-test");
+		const std::string param_cv_data		= cmdline.registerParameter("cv_data", "datasets of the -cv folds, e.g. android,ipad; default=android");
+		const std::string param_cv_dir		= cmdline.registerParameter("cv_dir", "directory with the train/ and test/ folders of the -cv folds; default=../cross_validation");
 
 		const std::string param_help            = cmdline.registerParameter("help", "this screen");
 
@@ -65,56 +324,236 @@ int main(int argc, char **argv) {
 		}
 		cmdline.checkParameters();
 
+		const int seed = cmdline.getValue(param_seed, (int) time(NULL));
+		ran_seed(seed);
+		banner_out << "Seed: " << seed << std::endl;
+
+		if (cmdline.hasParameter(param_processes) && (cmdline.hasParameter(param_cv) || cmdline.hasParameter(param_load_model) || (cmdline.hasParameter(param_mode) && cmdline.getValue(param_mode).compare("train")))) {
+			throw std::string("-processes trains a new model in -mode train only");
+		}
+		if (cmdline.hasParameter(param_cv)) {
+			runCrossValidation(cmdline);
+			return 0;
+		}
+
+		const std::string mode = cmdline.getValue(param_mode, std::string("train"));
+		const std::string out_format = cmdline.getValue(param_out_format, std::string("text"));
+		if (out_format.compare("text") && out_format.compare("binary")) {
+			throw "unknown output format " + out_format;
+		}
+		const bool binary_out = ! out_format.compare("binary");
+		if (! mode.compare("serve")) {
+			if (! cmdline.hasParameter(param_load_model)) {
+				throw std::string("-mode serve needs a model (-load_model)");
+			}
+			NextBasketRecommenderFPMC* fpmc = NextBasketRecommenderFPMC::create(NextBasketRecommenderFPMC::modelPrecision(cmdline.getValue(param_load_model)));
+			fpmc->loadModel(cmdline.getValue(param_load_model));
+			fpmc->num_threads = cmdline.getValue(param_threads, 1);
+			if (cmdline.hasParameter(param_mips_clusters)) {
+				fpmc->buildIndex(cmdline.getValue(param_mips_clusters, 64), cmdline.getValue(param_mips_probe, 8));
+			}
+			std::cerr << "Serving model " << cmdline.getValue(param_load_model) << ": users=" << fpmc->num_user << " items=" << fpmc->num_item << " precision=" << fpmc->precision() << std::endl;
+			PredictionServer server(*fpmc, fpmc->num_user, fpmc->num_item);
+			server.num_out = cmdline.getValue(param_num_pred_out, 10);
+			server.batch_size = cmdline.getValue(param_batch_size, 64);
+			server.run(std::cin, std::cout);
+			server.printStatistics(std::cerr);
+			delete fpmc;
+			return 0;
+		} else if (mode.compare("train") && mode.compare("update") && mode.compare("search")) {
+			throw "unknown mode " + mode;
+		}
+
+		RLog* rlog = NULL;
+		std::ofstream* out_rlog = NULL;
+		if (cmdline.hasParameter(param_log)) {
+			const std::string log_filename = cmdline.getValue(param_log);
+			out_rlog = new std::ofstream(log_filename.c_str());
+			if (! out_rlog->is_open()) {
+				throw "Unable to open file " + log_filename;
+			}
+			bool json = (log_filename.size() >= 5) && ! log_filename.compare(log_filename.size()-5, 5, ".json");
+			rlog = new RLog(out_rlog, json);
+			PhaseTimer::addFields(*rlog);
+			rlog->init();
+		}
+
 		// (1) Load the data
+		PhaseTimer phase_timer;
+		// a model trained on remapped ids brings its dictionaries; the data is mapped with them
+		IdDictionary user_ids, item_ids;
+		bool remap_ids = cmdline.hasParameter(param_remap_ids);
+		if (cmdline.hasParameter(param_load_model)) {
+			bool has_ids = NextBasketRecommenderFPMC::modelIds(cmdline.getValue(param_load_model), user_ids, item_ids);
+			if (remap_ids && ! has_ids) {
+				throw "the model " + cmdline.getValue(param_load_model) + " has no id mapping (trained without -remap_ids)";
+			}
+			remap_ids = has_ids;
+		}
 		std::cout << "Loading train...\t";
-		Dataset dataset = Dataset(cmdline.getValue(param_train_file));
-		std::cout << "Loading test... \t";
-	  	dataset.loadTestSplit(cmdline.getValue(param_test_file));
+		Dataset dataset(cmdline.getValue(param_train_file), cmdline.hasParameter(param_data_cache), cmdline.getValue(param_threads, 1), remap_ids ? &user_ids : NULL, remap_ids ? &item_ids : NULL);
+		if (cmdline.hasParameter(param_test_file) || mode.compare("update")) {
+			std::cout << "Loading test... \t";
+	  		dataset.loadTestSplit(cmdline.getValue(param_test_file));
+		}
+		if (rlog != NULL) {
+			// case_build is the part of the load that merges and sorts the parsed rows
+			double build_wall_time = dataset.data.build_wall_time + dataset.test_data.build_wall_time;
+			double build_cpu_time = dataset.data.build_cpu_time + dataset.test_data.build_cpu_time;
+			phase_timer.log(*rlog, "load");
+			rlog->log("wall_time", phase_timer.wallTime() - build_wall_time);
+			rlog->log("cpu_time", phase_timer.cpuTime() - build_cpu_time);
+			rlog->log("samples", dataset.data.size() + dataset.test_data.size());
+			rlog->newLine();
+			rlog->log("phase", "case_build");
+			rlog->log("wall_time", build_wall_time);
+			rlog->log("cpu_time", build_cpu_time);
+			rlog->log("samples", dataset.data.size() + dataset.test_data.size());
+			rlog->log("peak_rss_mb", getpeakrss());
+			rlog->newLine();
+		}
+		phase_timer.restart();
+
+		if (! mode.compare("search")) {
+			if (! cmdline.hasParameter(param_search_space)) {
+				throw std::string("-mode search needs a -search_space");
+			}
+			HyperparameterSearch search;
+			search.parseSpace(cmdline.getValue(param_search_space));
+			search.method = cmdline.getValue(param_search, std::string("halving"));
+			search.num_trials = cmdline.getValue(param_search_trials, 27);
+			search.min_iter = cmdline.getValue(param_search_min_iter, 4);
+			search.max_iter = cmdline.getValue(param_num_iter, 100);
+			search.eta = std::max(2, cmdline.getValue(param_search_eta, 3));
+			search.num_threads = cmdline.getValue(param_threads, 1);
+			const std::string precision = cmdline.getValue(param_precision, std::string("double"));
+			const FPMCOptions options = readFPMCOptions(cmdline);
+			search.create_model = [&]() { return createFPMC(options, precision, dataset); };
+			std::cout << "Hyperparameter search: " << search.method << " on " << search.num_threads << " thread(s)" << std::endl;
+			// the progress of the concurrent trials would interleave; every finished trial is reported on stderr
+			std::cout.setstate(std::ios::badbit);
+			int best;
+			try {
+				best = search.run(dataset);
+			} catch (...) {
+				std::cout.clear();
+				throw;
+			}
+			std::cout.clear();
+			search.report(std::cout);
+			if (cmdline.hasParameter(param_search_out)) {
+				std::ofstream out_file(cmdline.getValue(param_search_out).c_str());
+				if (! out_file.is_open()) {
+					throw "Unable to open file " + cmdline.getValue(param_search_out);
+				}
+				search.report(out_file);
+			}
+			if (best < 0) {
+				throw std::string("the search space has no configuration");
+			}
+			NextBasketRecommenderFPMC* fpmc = search.trials[best].model;
+			std::cout << "Best configuration: " << search.configString(search.trials[best]) << " -iter " << search.trials[best].num_iterations << "  MRR: " << search.trials[best].mrr << std::endl;
+			if (cmdline.hasParameter(param_save_model)) {
+				fpmc->saveModel(cmdline.getValue(param_save_model));
+			}
+			if (cmdline.hasParameter(param_out)) {
+				fpmc->savePrediction(dataset.test_data, cmdline.getValue(param_out), dataset.max_item_id+1, cmdline.getValue(param_num_pred_out, 10), binary_out);
+			}
+			return 0;
+		}
 		
 		// (2) Setup the learning method:
 		NextBasketRecommender* rec;
 		if (! cmdline.getValue(param_method).compare("fpmc")) {
 			std::cout << "Method: FPMC (BPR)" << std::endl;
-	 		NextBasketRecommenderFPMC *fpmc = new NextBasketRecommenderFPMC();
- 			
-			fpmc->loss_function = LOSS_FUNCTION_LN_SIGMOID;
-			fpmc->learn_rate = cmdline.getValue(param_learn_rate, 0.01);
-			fpmc->num_neg_samples = cmdline.getValue(param_num_sample, 100);
-	 		fpmc->num_iterations = cmdline.getValue(param_num_iter, 100);
-				
-			fpmc->num_user = dataset.max_user_id+1;
-			fpmc->num_item = dataset.max_item_id+1;
-		
-			fpmc->init_mean = 0;
-			fpmc->init_stdev = cmdline.getValue(param_init_stdev, 0.01);
-			
-			fpmc->num_feature = cmdline.getValue(param_dim, 64);
-			fpmc->regular_UI = cmdline.getValue(param_regular_UI, 0.01);
-			fpmc->regular_IU = cmdline.getValue(param_regular_IU, 0.01);
-			fpmc->regular_IL = cmdline.getValue(param_regular_IL, 0.01);
-			fpmc->regular_LI = cmdline.getValue(param_regular_LI, 0.01);
-			
-			fpmc->regular_MI = cmdline.getValue(param_regular_MI, 0.01);
-			fpmc->regular_IM = cmdline.getValue(param_regular_IM, 0.01);
+			std::string precision = cmdline.getValue(param_precision, std::string("double"));
+			if (cmdline.hasParameter(param_load_model)) {
+				std::string model_precision = NextBasketRecommenderFPMC::modelPrecision(cmdline.getValue(param_load_model));
+				if (cmdline.hasParameter(param_precision) && precision.compare(model_precision)) {
+					throw "-precision " + precision + " does not match the " + model_precision + " model " + cmdline.getValue(param_load_model);
+				}
+				precision = model_precision;
+			}
+	 		NextBasketRecommenderFPMC *fpmc = createFPMC(readFPMCOptions(cmdline), precision, dataset);
+			std::cout << "Precision: " << fpmc->precision() << std::endl;
+			fpmc->log = rlog;
 			
-			fpmc->init();
+			if (! mode.compare("update")) {
+				if (! cmdline.hasParameter(param_load_model)) {
+					throw std::string("-mode update needs a model (-load_model)");
+				}
+				fpmc->loadModel(cmdline.getValue(param_load_model));
+				int old_num_user = fpmc->num_user;
+				int old_num_item = fpmc->num_item;
+				fpmc->grow(std::max(fpmc->num_user, dataset.max_user_id+1), std::max(fpmc->num_item, dataset.max_item_id+1));
+				std::cout << "Model loaded: dim=" << fpmc->num_feature << " new users=" << fpmc->num_user - old_num_user << " new items=" << fpmc->num_item - old_num_item << std::endl;
+				// sample negatives from and evaluate on the whole catalogue
+				dataset.max_user_id = fpmc->num_user-1;
+				dataset.max_item_id = fpmc->num_item-1;
+				if (dataset.remap_ids) {
+					// the ids of the model and the unseen ones of the new rows
+					fpmc->user_ids = dataset.users;
+					fpmc->item_ids = dataset.items;
+				}
+				fpmc->num_iterations = cmdline.getValue(param_num_iter, 10);
+				fpmc->learn_rate = cmdline.getValue(param_learn_rate, fpmc->learn_rate);
+				fpmc->num_neg_samples = cmdline.getValue(param_num_sample, fpmc->num_neg_samples);
+			} else if (cmdline.hasParameter(param_load_model)) {
+				fpmc->loadModel(cmdline.getValue(param_load_model));
+				if ((fpmc->num_user < dataset.max_user_id+1) || (fpmc->num_item < dataset.max_item_id+1)) {
+					throw "the model " + cmdline.getValue(param_load_model) + " does not cover all users and items of the data";
+				}
+				std::cout << "Model loaded: dim=" << fpmc->num_feature << std::endl;
+			} else {
+				fpmc->num_processes = cmdline.getValue(param_processes, 1);
+				fpmc->init();
+			}
+			std::cout << "Transition: " << (fpmc->mean_transition ? "mean" : "position") << " of " << ((fpmc->history > 0) ? std::to_string(fpmc->history) : std::string("all")) << " history items" << std::endl;
 			rec = fpmc;
 
 		} else {
 			throw "unknown method";
 		}
 		rec->N = 10;
+		if (rlog != NULL) {
+			phase_timer.log(*rlog, "init");
+			rlog->newLine();
+		}
 
 		// (3) learning
 		double best_mrr = 0.0;
-		best_mrr = rec->train(dataset);
-		std::cout << "model trained" << std::endl;std::cout.flush();
+		if (cmdline.hasParameter(param_load_model) && mode.compare("update")) {
+			phase_timer.restart();
+			best_mrr = rec->evaluate(&dataset);
+			std::cout << "MRR:  " << best_mrr << std::endl;
+			if (rlog != NULL) {
+				phase_timer.log(*rlog, "evaluate");
+				rlog->log("mrr", best_mrr);
+				rlog->newLine();
+			}
+		} else {
+			best_mrr = rec->train(dataset);
+			std::cout << "model trained" << std::endl;std::cout.flush();
+		}
+		if (cmdline.hasParameter(param_save_model)) {
+			phase_timer.restart();
+			rec->saveModel(cmdline.getValue(param_save_model));
+			if (rlog != NULL) {
+				phase_timer.log(*rlog, "save_model");
+				rlog->newLine();
+			}
+		}
+		if (cmdline.hasParameter(param_mips_clusters)) {
+			rec->buildIndex(cmdline.getValue(param_mips_clusters, 64), cmdline.getValue(param_mips_probe, 8));
+			rec->reportIndex(&dataset);
+		}
 	 	//double avg_mrr = rec->evaluate(&dataset);
 	 	//std::cout << "MRR on test data: " << avg_mrr << std::endl;std::cout.flush();
 	 	
 		// (4) Save prediction
+		phase_timer.restart();
 		if (cmdline.hasParameter(param_out)) {
-			rec->savePrediction(dataset.test_baskets, cmdline.getValue(param_out), dataset.max_item_id+1, cmdline.getValue(param_num_pred_out, 10));	 	
+			rec->savePrediction(dataset.test_data, cmdline.getValue(param_out), dataset.max_item_id+1, cmdline.getValue(param_num_pred_out, 10), binary_out);	 	
 		}
 		// (5) Save best MRR
 		if (cmdline.hasParameter(param_mrr_out)) {
@@ -126,6 +565,15 @@ int main(int argc, char **argv) {
 				throw "Unable to open file " + cmdline.getValue(param_mrr_out);
 			}	
 		}
+		if (rlog != NULL) {
+			if (cmdline.hasParameter(param_out) || cmdline.hasParameter(param_mrr_out)) {
+				phase_timer.log(*rlog, "save_prediction");
+				rlog->newLine();
+			}
+			delete rlog;
+			out_rlog->close();
+			delete out_rlog;
+		}
 
 	} catch (std::string &e) {
 		std::cerr << e << std::endl;
@@ -16,20 +16,89 @@
 
 #include "Data.h"
 #include "NextBasketRecommender.h"
+#include "NegativeSampler.h"
+#include "../../util/rlog.h"
+#include "../../util/process_group.h"
 
 int LOSS_FUNCTION_SIGMOID = 0;
 int LOSS_FUNCTION_LN_SIGMOID = 1;
 using namespace std;
 
+// sigmoid(x) = 1/(1+exp(-x)) from a table with linear interpolation (absolute error < 1e-6)
+class SigmoidTable {
+	private:
+		static const int SIZE = 8192;
+		double range, scale;
+		double value[SIZE+2];
+	public:
+		SigmoidTable() {
+			range = 16.0;
+			scale = SIZE / (2 * range);
+			for (int i = 0; i <= SIZE+1; i++) {
+				value[i] = 1.0 / (1.0 + exp(-(i / scale - range)));
+			}
+		}
+		inline double operator()(double x) const {
+			if (x <= -range) {
+				return 0.0;
+			} else if (x >= range) {
+				return 1.0;
+			}
+			double pos = (x + range) * scale;
+			int i = (int) pos;
+			double w = pos - i;
+			return value[i] + w * (value[i+1] - value[i]);
+		}
+};
+
+const SigmoidTable fast_sigmoid;
+
+// wall clock and CPU time of one phase (load, case_build, init, sgd, evaluate, save_model, save_prediction) for the -log telemetry
+class PhaseTimer {
+	private:
+		double wall_start, cpu_start;
+	public:
+		PhaseTimer() { restart(); }
+		void restart() {
+			wall_start = getwalltime();
+			cpu_start = getcputime();
+		}
+		double wallTime() const { return getwalltime() - wall_start; }
+		double cpuTime() const { return getcputime() - cpu_start; }
+
+		// the columns of every telemetry line; fields that do not apply to a phase are NA
+		static void addFields(RLog& log) {
+			log.addField("phase", NAN);
+			log.addField("iter", NAN);
+			log.addField("wall_time", NAN);
+			log.addField("cpu_time", NAN);
+			log.addField("samples", NAN);
+			log.addField("samples_per_sec", NAN);
+			log.addField("loss", NAN);
+			log.addField("mrr", NAN);
+			log.addField("peak_rss_mb", NAN);
+		}
+		// logs the common fields of phase; further fields can be logged before log.newLine()
+		void log(RLog& log, const std::string& phase, int iteration = -1) const {
+			log.log("phase", phase);
+			if (iteration >= 0) {
+				log.log("iter", iteration);
+			}
+			log.log("wall_time", wallTime());
+			log.log("cpu_time", cpuTime());
+			log.log("peak_rss_mb", getpeakrss());
+		}
+};
+
 class BasketLearner {
 	public:
 		static inline double partial_loss(int loss_function, double x) {
 			if (loss_function == LOSS_FUNCTION_SIGMOID) {
-            			double sigmoid_tp_tn = (double) 1/(1+exp(-x));
+            			double sigmoid_tp_tn = fast_sigmoid(x);
               			return sigmoid_tp_tn*(1-sigmoid_tp_tn);
 			} else if (loss_function == LOSS_FUNCTION_LN_SIGMOID) {
-				double exp_x = exp(-x);
-     				return exp_x / (1 + exp_x);
+				// exp(-x) / (1 + exp(-x))
+     				return fast_sigmoid(-x);
      			} else {
 				assert((loss_function == LOSS_FUNCTION_LN_SIGMOID) || (loss_function == LOSS_FUNCTION_SIGMOID));	
 			}             			
@@ -41,103 +110,337 @@ class BasketLearner {
 
 class BasketLearnerBPR : BasketLearner{
 	private:
-		struct BasketCase {
-			int user_id;
-			int time_id;
-			int nextitem_id;
-			const SparseVectorBoolean* basket;
-		};	
 		int num_item;	
-		inline int drawNextItemNeg(Dataset& dataset, int nextitem_positive);
 	public:
 		int num_iterations;
 		int num_neg_samples;
+		// negative sampler: uniform, pop or adaptive (see NegativeSampler.h)
+		std::string sampler;
+		double sampler_lambda;
+		// stop as soon as the test MRR reaches this value and report the training time; 0 = off
+		double target_mrr;
+		// evaluate after every eval_every-th iteration (and the last one)
+		int eval_every;
+		// > 0: rank each test case against this many sampled negatives instead of all items
+		int eval_sample;
+		// stop after this many evaluations without a better MRR; 0 = off
+		int patience;
+		// snapshot the parameters of the best evaluation and restore them after training
+		bool keep_best;
+		// order of the SGD steps: "uniform" (cases drawn with replacement) or "blocked" (every
+		// iteration visits each block of cases with the same user and last item
+		// num_neg_samples / schedule_negatives times in shuffled order, and draws
+		// schedule_negatives negatives per case and visit while the rows of the block are in cache)
+		std::string schedule;
+		// number of cases per block and negatives per case and visit of the blocked schedule
+		int schedule_block, schedule_negatives;
+		// telemetry: one line per SGD iteration and evaluation (see PhaseTimer); NULL = off
+		RLog* log;
+		// number of fixed (case, negative) pairs of the loss estimate in the telemetry
+		int num_loss_samples;
+		// multi-process training: every process of the group runs train() on the factors in shared
+		// memory, draws only from its own shard of the cases and waits at the end of each iteration;
+		// the coordinator evaluates and decides whether to go on. NULL = one process
+		ProcessGroup* processes;
+
+		BasketLearnerBPR() {
+			sampler = "uniform";
+			sampler_lambda = 0.1;
+			target_mrr = 0;
+			eval_every = 1;
+			eval_sample = 0;
+			patience = 0;
+			keep_best = true;
+			schedule = "uniform";
+			schedule_block = 32;
+			schedule_negatives = 10;
+			log = NULL;
+			num_loss_samples = 1000;
+			processes = NULL;
+		}
 		virtual double train(Dataset& dataset, NextBasketRecommender& rec);	
+		// mean -ln sigmoid(x_p - x_n) over num_loss_samples pairs drawn from seed with uniform negatives
+		double estimateLoss(const BasketCaseDB& cases, NextBasketRecommender& rec, uint64_t seed);
 };
 
+double BasketLearnerBPR::estimateLoss(const BasketCaseDB& cases, NextBasketRecommender& rec, uint64_t seed) {
+	if ((cases.size() == 0) || (num_item < 2)) {
+		return NAN;
+	}
+	Random rng(seed);
+	double loss = 0;
+	for (int i = 0; i < num_loss_samples; i++) {
+		int p = rng.bounded(cases.size());
+		int ni_n;
+		do {
+			ni_n = rng.bounded(num_item);
+		} while (ni_n == cases.next_item[p]);
+		BasketRef basket = cases.basket(p);
+		double x = rec.predict(cases.user_id[p], cases.time_id[p], cases.next_item[p], basket) - rec.predict(cases.user_id[p], cases.time_id[p], ni_n, basket);
+		// ln(1 + exp(-x)) without overflow
+		loss += (x > 0) ? log1p(exp(-x)) : -x + log1p(exp(x));
+	}
+	return loss / num_loss_samples;
+}
+
 double BasketLearnerBPR::train(Dataset& dataset, NextBasketRecommender& rec) {
-	double total_time = getusertime();
+	double total_time = getwalltime();
 
 	num_item = dataset.max_item_id + 1;
 	
 	std::cout << "Training BPR (Case-Update):"
 			<< " num_iter=" << num_iterations
 			<< " neg_samples=" << num_neg_samples
+			<< " sampler=" << sampler
+			<< " eval_every=" << eval_every
+			<< " eval_sample=" << eval_sample
+			<< " patience=" << patience
+			<< " schedule=" << schedule
 			<< std::endl;
 			
 	double f_best_mrr_measure = -1;
 	int f_best_mrr_iteridx = -1;	
+	// without test cases (e.g. -mode update without -test) every MRR would be 0
+	bool has_test_data = (dataset.test_data.size() > 0);
 
-	// build basket case db: {user, time, {next_item, itemset}}
-	int num_basket_case = 0; 
-	//user
-	for(SparseFourDimBoolean::const_iterator t = dataset.data.begin(); t != dataset.data.end(); ++t) {
-		//time
-		for(SparseTensorBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-			num_basket_case += i->second.size();
-		}
-	}
+	// basket case db: {user, time, {next_item, itemset}}
+	const BasketCaseDB& basket_case = dataset.data;
+	int num_basket_case = basket_case.size();
 	std::cout << "num_basket_case:" << num_basket_case << endl;
-	BasketCase* basket_case = new BasketCase[num_basket_case];
-	{
-		int cntr = 0;
-		//user
-		for(SparseFourDimBoolean::const_iterator t = dataset.data.begin(); t != dataset.data.end(); ++t) {
-			//time
-			for(SparseTensorBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-				//next_item
-				for(SparseMatrixBoolean::const_iterator j = i->second.begin(); j != i->second.end(); ++j) {
-					basket_case[cntr].user_id = t->first;
-					basket_case[cntr].time_id = i->first;
-					basket_case[cntr].basket = & (j->second);
-					basket_case[cntr].nextitem_id = j->first;
-					cntr++;
-				}
+
+	// the cases [case_begin, case_end) of this process; all of them without a process group
+	int rank = (processes != NULL) ? processes->rank : 0;
+	int num_processes = (processes != NULL) ? processes->num_processes : 1;
+	int case_begin = (int) ((long long) num_basket_case * rank / num_processes);
+	int case_end = (int) ((long long) num_basket_case * (rank+1) / num_processes);
+	int num_shard_case = case_end - case_begin;
+
+	// draws of all processes (reported) and of this process
+	long long num_draws_per_iteration = (long long) num_basket_case * num_neg_samples;
+	long long num_shard_draws = (long long) num_shard_case * num_neg_samples;
+	ThreadPool& pool = rec.threadPool();
+	// every worker draws from its own stream; all streams derive from the global seed, which
+	// is the same in all processes of a group
+	uint64_t train_seed = ran_global().next();
+	uint64_t first_stream = (uint64_t) rank * (pool.num_threads+1);
+	std::vector<Random> thread_rng(pool.num_threads);
+	for (int i = 0; i < pool.num_threads; i++) {
+		thread_rng[i].setSeed(train_seed, first_stream + i);
+	}
+	std::cout << "num_threads:" << pool.num_threads << endl;
+	if (num_processes > 1) {
+		std::cout << "num_processes:" << num_processes << endl;
+	}
+		
+	NegativeSampler* negative_sampler = createNegativeSampler(sampler, sampler_lambda);
+	negative_sampler->init(basket_case, num_item);
+	// adaptive samplers are refreshed between rounds of at most refresh_interval draws
+	long long refresh_interval = negative_sampler->refreshInterval();
+	long long round_size = (refresh_interval > 0) ? refresh_interval : num_shard_draws;
+	double train_time = 0;
+	// seed of the sampled evaluation; the same negatives at every evaluation keep the values comparable
+	uint64_t eval_seed = ran_global().next();
+	int num_evals_without_improvement = 0;
+	// the loss is estimated on the same pairs after every iteration
+	uint64_t loss_seed = ran_global().next();
+
+	bool is_blocked = ! schedule.compare("blocked");
+	if (! is_blocked && schedule.compare("uniform")) {
+		throw "unknown schedule " + schedule;
+	}
+	// blocked schedule: the cases in (user, last item) order, cut into blocks; every iteration
+	// shuffles num_visits visits of every block
+	std::vector<int> block_case;
+	std::vector<int> block_order;
+	int block_size = std::max(schedule_block, 1);
+	int visit_negatives = std::max(1, std::min(schedule_negatives, num_neg_samples));
+	int num_visits = (num_neg_samples + visit_negatives - 1) / visit_negatives;
+	int num_case_blocks = (num_shard_case + block_size - 1) / block_size;
+	Random schedule_rng(train_seed, first_stream + pool.num_threads);
+	if (is_blocked) {
+		block_case.resize(num_shard_case);
+		for (int c = 0; c < num_shard_case; c++) {
+			block_case[c] = case_begin + c;
+		}
+		// the db is sorted by user already; stable_sort keeps the time order within a last item
+		std::stable_sort(block_case.begin(), block_case.end(), [&](int a, int b) {
+			if (basket_case.user_id[a] != basket_case.user_id[b]) {
+				return basket_case.user_id[a] < basket_case.user_id[b];
 			}
+			return basket_case.basket(a)[0] < basket_case.basket(b)[0];
+		});
+		block_order.resize((long long) num_case_blocks * num_visits);
+		for (uint b = 0; b < block_order.size(); b++) {
+			// visit v of block b is v * num_case_blocks + b
+			block_order[b] = b;
 		}
 	}
-
-
-	long long num_draws_per_iteration = num_basket_case * num_neg_samples;
+	int num_blocks = block_order.size();
+	int blocks_per_round = std::max(1LL, round_size / ((long long) block_size * visit_negatives));
 		
 	for (int iteration = 0; iteration < num_iterations; iteration++) {
-		double iteration_time = getusertime();
-		for (int draw = 0; draw < num_draws_per_iteration; draw++) {
-			int p  = rand() % num_basket_case;
-			int u  = basket_case[p].user_id;
-			int t  = basket_case[p].time_id;
-			int ni_p = basket_case[p].nextitem_id;
-			int ni_n = drawNextItemNeg(dataset, ni_p);
-			rec.learn(u, t, ni_p, ni_n, basket_case[p].basket);
+		PhaseTimer sgd_timer;
+		double iteration_time = getwalltime();
+		for (int i = num_blocks-1; i > 0; i--) {
+			std::swap(block_order[i], block_order[schedule_rng.bounded(i+1)]);
+		}
+		for (int round_begin = 0; round_begin < num_blocks; round_begin += blocks_per_round) {
+			int num_round_blocks = std::min(blocks_per_round, num_blocks - round_begin);
+			if (refresh_interval > 0) {
+				negative_sampler->refresh(rec);
+			}
+			pool.run([&](int thread_id) {
+				Random rng = thread_rng[thread_id];
+				std::vector<int> negatives(visit_negatives);
+				int block_end = round_begin + pool.rangeBegin(num_round_blocks, thread_id+1);
+				for (int block = round_begin + pool.rangeBegin(num_round_blocks, thread_id); block < block_end; block++) {
+					int visit = block_order[block] / num_case_blocks;
+					int c_begin = (block_order[block] % num_case_blocks) * block_size;
+					int c_end = std::min(c_begin + block_size, num_shard_case);
+					// the last visit draws the remaining negatives
+					int num_visit_negatives = std::min(visit_negatives, num_neg_samples - visit * visit_negatives);
+					// the negatives of a case in a row: the model can reuse its work on the case
+					for (int c = c_begin; c < c_end; c++) {
+						int p  = block_case[c];
+						int u  = basket_case.user_id[p];
+						int ni_p = basket_case.next_item[p];
+						BasketRef basket = basket_case.basket(p);
+						for (int j = 0; j < num_visit_negatives; j++) {
+							negatives[j] = negative_sampler->draw(rng, u, ni_p, basket);
+						}
+						rec.learnNegatives(u, basket_case.time_id[p], ni_p, &negatives[0], num_visit_negatives, basket);
+					}
+				}
+				thread_rng[thread_id] = rng;
+			});
+		}
+		for (long long round_begin = 0; (round_begin < num_shard_draws) && ! is_blocked; round_begin += round_size) {
+			long long num_round_draws = std::min(round_size, num_shard_draws - round_begin);
+			if (refresh_interval > 0) {
+				negative_sampler->refresh(rec);
+			}
+			// Hogwild: workers update the shared factors without locking
+			pool.run([&](int thread_id) {
+				// a local copy keeps the generator state out of the shared cache lines
+				Random rng = thread_rng[thread_id];
+				long long draw_end = pool.rangeBegin(num_round_draws, thread_id+1);
+				for (long long draw = pool.rangeBegin(num_round_draws, thread_id); draw < draw_end; draw++) {
+					int p  = case_begin + rng.bounded(num_shard_case);
+					int u  = basket_case.user_id[p];
+					int t  = basket_case.time_id[p];
+					int ni_p = basket_case.next_item[p];
+					BasketRef basket = basket_case.basket(p);
+					int ni_n = negative_sampler->draw(rng, u, ni_p, basket);
+					rec.learn(u, t, ni_p, ni_n, basket);
+				}
+				thread_rng[thread_id] = rng;
+			});
+		}
+		if (processes != NULL) {
+			// workers stop here until the coordinator has evaluated this iteration
+			bool go_on = processes->barrier();
+			if (! processes->isCoordinator()) {
+				if (! go_on) {
+					break;
+				}
+				continue;
+			}
 		}
 		
-		iteration_time = (getusertime() - iteration_time);
+		iteration_time = (getwalltime() - iteration_time);
+		train_time += iteration_time;
 		std::cout << "Time: " << iteration_time << " / ";
+		std::cout << "Samples/s: " << (double) num_draws_per_iteration / iteration_time << " / ";
+		if (log != NULL) {
+			sgd_timer.log(*log, "sgd", iteration);
+			log->log("samples", num_draws_per_iteration);
+			log->log("samples_per_sec", (double) num_draws_per_iteration / iteration_time);
+			log->log("loss", estimateLoss(basket_case, rec, loss_seed));
+			log->newLine();
+		}
 
 		std::cout << "Iteration(" << iteration << "/" << num_iterations << ")  ";
-		double this_mrr_measure = rec.evaluate(&dataset);
-		f_best_mrr_measure = std::max(this_mrr_measure, f_best_mrr_measure);
+		if (! has_test_data) {
+			// nothing to compare: no snapshot and no early stop, the last iteration is the model
+			std::cout << "no test data" << std::endl;
+			if (processes != NULL) {
+				processes->release(true);
+			}
+			continue;
+		}
+		if (((iteration+1) % std::max(eval_every, 1) != 0) && (iteration < num_iterations-1)) {
+			std::cout << std::endl;
+			if (processes != NULL) {
+				processes->release(true);
+			}
+			continue;
+		}
+		PhaseTimer eval_timer;
+		double this_mrr_measure = (eval_sample > 0) ? rec.evaluateSampled(&dataset, eval_sample, eval_seed) : rec.evaluate(&dataset);
+		if (log != NULL) {
+			eval_timer.log(*log, (eval_sample > 0) ? "evaluate_sampled" : "evaluate", iteration);
+			log->log("mrr", this_mrr_measure);
+			log->newLine();
+		}
+		if (this_mrr_measure > f_best_mrr_measure) {
+			f_best_mrr_measure = this_mrr_measure;
+			f_best_mrr_iteridx = iteration;
+			num_evals_without_improvement = 0;
+			if (keep_best) {
+				rec.saveSnapshot();
+			}
+		} else {
+			num_evals_without_improvement++;
+		}
 		
-		std::cout << "MRR:  " << this_mrr_measure << std::endl;
+		std::cout << "MRR" << ((eval_sample > 0) ? " (sampled)" : "") << ":  " << this_mrr_measure << std::endl;
 		std::cout << "best MRR:  " << f_best_mrr_measure << std::endl;
 
 		//rec.auto_save();
+		bool stop = false;
+		if ((target_mrr > 0) && (this_mrr_measure >= target_mrr)) {
+			std::cout << "Target MRR " << target_mrr << " reached after " << train_time << " s of training (iteration " << iteration << ")" << std::endl;
+			stop = true;
+		} else if ((target_mrr > 0) && (iteration == num_iterations-1)) {
+			std::cout << "Target MRR " << target_mrr << " not reached after " << train_time << " s of training" << std::endl;
+		}
+		if (! stop && (patience > 0) && (num_evals_without_improvement >= patience)) {
+			std::cout << "Early stop: no better MRR in the last " << patience << " evaluations" << std::endl;
+			stop = true;
+		}
+		if (processes != NULL) {
+			processes->release(! stop);
+		}
+		if (stop) {
+			break;
+		}
 	}
-	delete [] basket_case;
-	
-	total_time = (getusertime() - total_time);
+	if ((processes != NULL) && ! processes->isCoordinator()) {
+		// the coordinator restores, evaluates and reports the model
+		delete negative_sampler;
+		return 0;
+	}
+	if (keep_best && (f_best_mrr_iteridx >= 0)) {
+		rec.restoreSnapshot();
+		std::cout << "Restored the model of iteration " << f_best_mrr_iteridx << std::endl;
+	}
+	if ((eval_sample > 0) && (f_best_mrr_iteridx >= 0)) {
+		std::cout << "Full evaluation of the " << (keep_best ? "best" : "last") << " model  ";
+		PhaseTimer eval_timer;
+		f_best_mrr_measure = rec.evaluate(&dataset);
+		if (log != NULL) {
+			eval_timer.log(*log, "evaluate", f_best_mrr_iteridx);
+			log->log("mrr", f_best_mrr_measure);
+			log->newLine();
+		}
+		std::cout << "MRR:  " << f_best_mrr_measure << std::endl;
+	}
+	delete negative_sampler;
+	total_time = (getwalltime() - total_time);
 	std::cout << "training time: " << total_time << " s" << std::endl;
 	
-	return f_best_mrr_measure;
-}
-
-
-inline int BasketLearnerBPR::drawNextItemNeg(Dataset& dataset, int nextitem_positive) {
-	int nextitem_negative;
-	do {
-		nextitem_negative = rand() % num_item;		
-	} while (nextitem_negative == nextitem_positive);
-	return nextitem_negative;
+	// an MRR of 0 (as evaluate() on no cases) if nothing was evaluated
+	return has_test_data ? f_best_mrr_measure : 0;
 }
 
 
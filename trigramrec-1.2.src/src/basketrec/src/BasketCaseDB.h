@@ -0,0 +1,476 @@
+/*
+	Flat (CSR) store of basket cases
+
+	Every case (user, time, next_item, history) is one row of the columnar
+	arrays user_id/time_id/next_item. The history baskets of all cases are
+	concatenated in basket_item; the history of case c is
+	basket_item[basket_offset[c] .. basket_offset[c+1]) with the most recent
+	item first. Rows are sorted by (user, time, next_item); rows with the same
+	key are merged by appending their histories in file order.
+
+	The columns are read-only views: they point either into vectors owned by
+	the db (after parsing a text file) or into a mapped binary cache file.
+	Without dictionaries the user and item ids of the file are used as they
+	are; with dictionaries (see IdDictionary.h) they are raw tokens that are
+	mapped to dense ids.
+*/
+
+#ifndef BASKETCASEDB_H_
+#define BASKETCASEDB_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <sys/stat.h>
+
+#include "../../util/util.h"
+#include "../../util/mapped_file.h"
+#include "../../util/fast_parser.h"
+#include "../../util/thread_pool.h"
+#include "IdDictionary.h"
+
+// read-only view of one history basket <item_n-1, item_n-2, ...>
+class BasketRef {
+	public:
+		typedef const int* const_iterator;
+		const int* item;
+		int length;
+
+		BasketRef() { item = NULL; length = 0; }
+		BasketRef(const int* p_item, int p_length) { item = p_item; length = p_length; }
+
+		const_iterator begin() const { return item; }
+		const_iterator end() const { return item + length; }
+		int size() const { return length; }
+		int operator[] (int i) const { return item[i]; }
+};
+
+// read-only view of a column
+template <typename T> class ArrayRef {
+	public:
+		typedef const T* const_iterator;
+		const T* value;
+		size_t length;
+
+		ArrayRef() { value = NULL; length = 0; }
+		void assign(const T* p_value, size_t p_length) { value = p_value; length = p_length; }
+
+		const_iterator begin() const { return value; }
+		const_iterator end() const { return value + length; }
+		size_t size() const { return length; }
+		const T& operator[] (size_t i) const { return value[i]; }
+};
+
+// binary cache file: this header, then the columns user_id, time_id, next_item,
+// basket_offset and basket_item, each starting at a multiple of CASE_CACHE_ALIGNMENT
+const char CASE_CACHE_MAGIC[8] = { 'F', 'P', 'M', 'C', 'D', 'A', 'T', 'A' };
+const int CASE_CACHE_VERSION = 1;
+const int CASE_CACHE_ALIGNMENT = 64;
+
+struct BasketCaseCacheHeader {
+	char magic[8];
+	int version;
+	int max_user_id, max_time_id, max_item_id;
+	// size and modification time of the text file the cache was built from
+	long long source_size, source_mtime;
+	long long num_case, num_basket_item;
+	long long offset_user_id, offset_time_id, offset_next_item, offset_basket_offset, offset_basket_item;
+};
+
+class BasketCaseDB {
+	private:
+		std::vector<int> user_id_data;
+		std::vector<int> time_id_data;
+		std::vector<int> next_item_data;
+		std::vector<long long> basket_offset_data;
+		std::vector<int> basket_item_data;
+		// backing memory of a db opened with loadCache
+		MappedFile cache_file;
+
+		BasketCaseDB(const BasketCaseDB&);
+		BasketCaseDB& operator=(const BasketCaseDB&);
+
+		void updateRefs() {
+			user_id.assign(user_id_data.data(), user_id_data.size());
+			time_id.assign(time_id_data.data(), time_id_data.size());
+			next_item.assign(next_item_data.data(), next_item_data.size());
+			basket_offset.assign(basket_offset_data.data(), basket_offset_data.size());
+			basket_item.assign(basket_item_data.data(), basket_item_data.size());
+		}
+
+		static bool statFile(const std::string& filename, long long& size, long long& mtime) {
+			struct stat st;
+			if (stat(filename.c_str(), &st) != 0) {
+				return false;
+			}
+			size = st.st_size;
+			mtime = st.st_mtime;
+			return true;
+		}
+
+		static long long alignOffset(long long pos) {
+			return (pos + CASE_CACHE_ALIGNMENT - 1) / CASE_CACHE_ALIGNMENT * CASE_CACHE_ALIGNMENT;
+		}
+
+		// true if num values of size bytes at offset lie behind the header and inside a file of file_size bytes
+		static bool sectionFits(long long offset, long long num, long long size, long long file_size) {
+			return (offset >= (long long) sizeof(BasketCaseCacheHeader)) && (offset % size == 0) && (num >= 0)
+				&& (offset <= file_size) && (num <= (file_size - offset) / size);
+		}
+		// true if the ids of the mapped cache are within the header's maxima and the baskets are consistent
+		bool checkCache() const;
+
+		static void writeAligned(std::ofstream& out, long long& pos, long long offset, const void* data, long long length) {
+			for (; pos < offset; pos++) {
+				out.put(0);
+			}
+			out.write((const char*) data, length);
+			pos += length;
+		}
+	public:
+		ArrayRef<int> user_id;
+		ArrayRef<int> time_id;
+		ArrayRef<int> next_item;
+		ArrayRef<long long> basket_offset;
+		ArrayRef<int> basket_item;
+
+		int max_user_id, max_time_id, max_item_id;
+		// time fromFile spent merging the parsed chunks into the sorted case columns
+		double build_wall_time, build_cpu_time;
+
+		BasketCaseDB() { clear(); }
+
+		int size() const { return user_id.size(); }
+
+		BasketRef basket(int c) const {
+			return BasketRef(basket_item.value + basket_offset[c], basket_offset[c+1] - basket_offset[c]);
+		}
+
+		void clear() {
+			cache_file.close();
+			user_id_data.clear();
+			time_id_data.clear();
+			next_item_data.clear();
+			basket_offset_data.assign(1, 0);
+			basket_item_data.clear();
+			max_user_id = -1;
+			max_time_id = -1;
+			max_item_id = -1;
+			build_wall_time = 0;
+			build_cpu_time = 0;
+			updateRefs();
+		}
+
+		// appends one case; the history is given in the order it is stored (most recent first)
+		void add(int user, int time, int item, const int* history, int history_length) {
+			assert(! cache_file.isOpen());
+			user_id_data.push_back(user);
+			time_id_data.push_back(time);
+			next_item_data.push_back(item);
+			basket_item_data.insert(basket_item_data.end(), history, history + history_length);
+			basket_offset_data.push_back(basket_item_data.size());
+			updateRefs();
+		}
+
+		// parses the text file on num_threads threads; with dictionaries the user and item ids
+		// are looked up in (or added to) users and items
+		void fromFile(const std::string &filename, int num_threads = 1, IdDictionary* users = NULL, IdDictionary* items = NULL);
+		void sortAndMerge();
+		void computeMaxIds();
+		// replaces every item id i by new_id[i] and sorts the cases again
+		void renumberItems(const std::vector<int>& new_id);
+
+		// maps the binary cache of filename; returns false if there is none or it is stale
+		bool loadCache(const std::string& cache_filename, const std::string& source_filename);
+		void saveCache(const std::string& cache_filename, const std::string& source_filename);
+};
+
+
+void BasketCaseDB::fromFile(const std::string &filename, int num_threads, IdDictionary* users, IdDictionary* items) {
+	clear();
+	MappedFile text;
+	text.open(filename);
+	const char* end = text.begin() + text.size();
+	ThreadPool pool(num_threads);
+	std::vector<const char*> bounds = splitAtLines(text.begin(), end, pool.num_threads);
+
+	// every thread parses its chunk into its own columns, rows in file order; raw ids are
+	// numbered per chunk first and translated while the chunks are merged in file order
+	std::vector<BasketCaseDB> chunk(pool.num_threads);
+	std::vector<IdDictionary> chunk_users((users != NULL) ? pool.num_threads : 0);
+	std::vector<IdDictionary> chunk_items((items != NULL) ? pool.num_threads : 0);
+	pool.run([&](int thread_id) {
+		BasketCaseDB& cases = chunk[thread_id];
+		const char* chunk_end = bounds[thread_id+1];
+		IdDictionary* user_dict = (users != NULL) ? &chunk_users[thread_id] : NULL;
+		IdDictionary* item_dict = (items != NULL) ? &chunk_items[thread_id] : NULL;
+		auto scanId = [&](const char*& p, long long& id, IdDictionary* dict) {
+			if (dict == NULL) {
+				return scanInt(p, chunk_end, id);
+			}
+			const char* token;
+			int length;
+			if (! scanToken(p, chunk_end, token, length)) {
+				return false;
+			}
+			id = dict->add(std::string(token, length));
+			return true;
+		};
+		std::vector<int> seq;
+		for (const char* p = bounds[thread_id]; p < chunk_end; p = nextLine(p, chunk_end)) {
+			long long userid, timeid, seqlength, itemid, next_itemid;
+			if (! scanId(p, userid, user_dict) || ! scanInt(p, chunk_end, timeid) || ! scanInt(p, chunk_end, seqlength)) {
+				continue;
+			}
+			seq.clear();
+			bool is_missing = false;
+			for (long long i = 0; i < seqlength-1; i++) {
+				if (! scanId(p, itemid, item_dict)) {
+					is_missing = true;
+					break;
+				}
+				seq.push_back(itemid);
+			}
+			if (is_missing || ! scanId(p, next_itemid, item_dict)) {
+				continue;
+			}
+			std::reverse(seq.begin(), seq.end());
+			cases.user_id_data.push_back(userid);
+			cases.time_id_data.push_back(timeid);
+			cases.next_item_data.push_back(next_itemid);
+			cases.basket_item_data.insert(cases.basket_item_data.end(), seq.begin(), seq.end());
+			cases.basket_offset_data.push_back(cases.basket_item_data.size());
+		}
+	});
+
+	double build_start = getwalltime();
+	double build_cpu_start = getcputime();
+	size_t num_rows = 0;
+	size_t num_items = 0;
+	for (int i = 0; i < pool.num_threads; i++) {
+		num_rows += chunk[i].user_id_data.size();
+		num_items += chunk[i].basket_item_data.size();
+	}
+	user_id_data.reserve(num_rows);
+	time_id_data.reserve(num_rows);
+	next_item_data.reserve(num_rows);
+	basket_offset_data.reserve(num_rows+1);
+	basket_item_data.reserve(num_items);
+	for (int i = 0; i < pool.num_threads; i++) {
+		if (users != NULL) {
+			std::vector<int> user_map(chunk_users[i].size());
+			for (uint k = 0; k < user_map.size(); k++) {
+				user_map[k] = users->add(chunk_users[i].name(k));
+			}
+			for (uint c = 0; c < chunk[i].user_id_data.size(); c++) {
+				chunk[i].user_id_data[c] = user_map[chunk[i].user_id_data[c]];
+			}
+		}
+		if (items != NULL) {
+			std::vector<int> item_map(chunk_items[i].size());
+			for (uint k = 0; k < item_map.size(); k++) {
+				item_map[k] = items->add(chunk_items[i].name(k));
+			}
+			for (uint c = 0; c < chunk[i].next_item_data.size(); c++) {
+				chunk[i].next_item_data[c] = item_map[chunk[i].next_item_data[c]];
+			}
+			for (uint k = 0; k < chunk[i].basket_item_data.size(); k++) {
+				chunk[i].basket_item_data[k] = item_map[chunk[i].basket_item_data[k]];
+			}
+		}
+		long long offset = basket_item_data.size();
+		user_id_data.insert(user_id_data.end(), chunk[i].user_id_data.begin(), chunk[i].user_id_data.end());
+		time_id_data.insert(time_id_data.end(), chunk[i].time_id_data.begin(), chunk[i].time_id_data.end());
+		next_item_data.insert(next_item_data.end(), chunk[i].next_item_data.begin(), chunk[i].next_item_data.end());
+		basket_item_data.insert(basket_item_data.end(), chunk[i].basket_item_data.begin(), chunk[i].basket_item_data.end());
+		for (size_t c = 1; c < chunk[i].basket_offset_data.size(); c++) {
+			basket_offset_data.push_back(offset + chunk[i].basket_offset_data[c]);
+		}
+		chunk[i].clear();
+	}
+	updateRefs();
+	sortAndMerge();
+	computeMaxIds();
+	build_wall_time = getwalltime() - build_start;
+	build_cpu_time = getcputime() - build_cpu_start;
+}
+
+void BasketCaseDB::sortAndMerge() {
+	int num_rows = size();
+	// files written in (user, time, next_item) order need no work
+	bool is_sorted = true;
+	for (int c = 1; (c < num_rows) && is_sorted; c++) {
+		is_sorted = (user_id[c-1] < user_id[c]) || ((user_id[c-1] == user_id[c]) && ((time_id[c-1] < time_id[c])
+			|| ((time_id[c-1] == time_id[c]) && (next_item[c-1] < next_item[c]))));
+	}
+	if (is_sorted) {
+		return;
+	}
+	std::vector<int> order(num_rows);
+	for (int c = 0; c < num_rows; c++) {
+		order[c] = c;
+	}
+	std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+		if (user_id[a] != user_id[b]) { return user_id[a] < user_id[b]; }
+		if (time_id[a] != time_id[b]) { return time_id[a] < time_id[b]; }
+		return next_item[a] < next_item[b];
+	});
+
+	BasketCaseDB sorted;
+	sorted.user_id_data.reserve(num_rows);
+	sorted.time_id_data.reserve(num_rows);
+	sorted.next_item_data.reserve(num_rows);
+	sorted.basket_offset_data.reserve(num_rows+1);
+	sorted.basket_item_data.reserve(basket_item.size());
+	for (int i = 0; i < num_rows; i++) {
+		int c = order[i];
+		BasketRef history = basket(c);
+		int last = sorted.size() - 1;
+		if ((last >= 0) && (sorted.user_id[last] == user_id[c]) && (sorted.time_id[last] == time_id[c]) && (sorted.next_item[last] == next_item[c])) {
+			sorted.basket_item_data.insert(sorted.basket_item_data.end(), history.begin(), history.end());
+			sorted.basket_offset_data[last+1] = sorted.basket_item_data.size();
+			sorted.updateRefs();
+		} else {
+			sorted.add(user_id[c], time_id[c], next_item[c], history.begin(), history.size());
+		}
+	}
+	user_id_data.swap(sorted.user_id_data);
+	time_id_data.swap(sorted.time_id_data);
+	next_item_data.swap(sorted.next_item_data);
+	basket_offset_data.swap(sorted.basket_offset_data);
+	basket_item_data.swap(sorted.basket_item_data);
+	updateRefs();
+}
+
+void BasketCaseDB::computeMaxIds() {
+	max_user_id = -1;
+	max_time_id = -1;
+	max_item_id = -1;
+	for (int c = 0; c < size(); c++) {
+		max_user_id = std::max(user_id[c], max_user_id);
+		max_time_id = std::max(time_id[c], max_time_id);
+		max_item_id = std::max(next_item[c], max_item_id);
+	}
+	//item_n-1, item_n-2, ...
+	for (size_t k = 0; k < basket_item.size(); k++) {
+		max_item_id = std::max(basket_item[k], max_item_id);
+	}
+}
+
+void BasketCaseDB::renumberItems(const std::vector<int>& new_id) {
+	assert(! cache_file.isOpen());
+	for (uint c = 0; c < next_item_data.size(); c++) {
+		next_item_data[c] = new_id[next_item_data[c]];
+	}
+	for (uint k = 0; k < basket_item_data.size(); k++) {
+		basket_item_data[k] = new_id[basket_item_data[k]];
+	}
+	updateRefs();
+	sortAndMerge();
+	computeMaxIds();
+}
+
+bool BasketCaseDB::loadCache(const std::string& cache_filename, const std::string& source_filename) {
+	long long source_size, source_mtime, cache_size, cache_mtime;
+	if (! statFile(cache_filename, cache_size, cache_mtime) || (cache_size < (long long) sizeof(BasketCaseCacheHeader))) {
+		return false;
+	}
+	// without the text file the cache is used as it is
+	bool has_source = statFile(source_filename, source_size, source_mtime);
+
+	clear();
+	cache_file.open(cache_filename);
+	BasketCaseCacheHeader header;
+	memcpy(&header, cache_file.begin(), sizeof(header));
+	if ((memcmp(header.magic, CASE_CACHE_MAGIC, sizeof(header.magic)) != 0) || (header.version != CASE_CACHE_VERSION)
+		|| (has_source && ((header.source_size != source_size) || (header.source_mtime != source_mtime)))
+		|| (header.num_case > INT_MAX)
+		|| ! sectionFits(header.offset_user_id, header.num_case, sizeof(int), cache_size)
+		|| ! sectionFits(header.offset_time_id, header.num_case, sizeof(int), cache_size)
+		|| ! sectionFits(header.offset_next_item, header.num_case, sizeof(int), cache_size)
+		|| ! sectionFits(header.offset_basket_offset, header.num_case+1, sizeof(long long), cache_size)
+		|| ! sectionFits(header.offset_basket_item, header.num_basket_item, sizeof(int), cache_size)) {
+		clear();
+		return false;
+	}
+	const char* base = cache_file.begin();
+	user_id.assign((const int*) (base + header.offset_user_id), header.num_case);
+	time_id.assign((const int*) (base + header.offset_time_id), header.num_case);
+	next_item.assign((const int*) (base + header.offset_next_item), header.num_case);
+	basket_offset.assign((const long long*) (base + header.offset_basket_offset), header.num_case+1);
+	basket_item.assign((const int*) (base + header.offset_basket_item), header.num_basket_item);
+	max_user_id = header.max_user_id;
+	max_time_id = header.max_time_id;
+	max_item_id = header.max_item_id;
+	if (! checkCache()) {
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool BasketCaseDB::checkCache() const {
+	long long num_basket_item = basket_item.size();
+	if ((basket_offset[0] != 0) || (basket_offset[size()] != num_basket_item)) {
+		return false;
+	}
+	for (int c = 0; c < size(); c++) {
+		if ((basket_offset[c] > basket_offset[c+1])
+			|| (user_id[c] < 0) || (user_id[c] > max_user_id)
+			|| (time_id[c] < 0) || (time_id[c] > max_time_id)
+			|| (next_item[c] < 0) || (next_item[c] > max_item_id)) {
+			return false;
+		}
+	}
+	for (long long k = 0; k < num_basket_item; k++) {
+		if ((basket_item[k] < 0) || (basket_item[k] > max_item_id)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void BasketCaseDB::saveCache(const std::string& cache_filename, const std::string& source_filename) {
+	BasketCaseCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CASE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = CASE_CACHE_VERSION;
+	header.max_user_id = max_user_id;
+	header.max_time_id = max_time_id;
+	header.max_item_id = max_item_id;
+	if (! statFile(source_filename, header.source_size, header.source_mtime)) {
+		throw "Unable to open file " + source_filename;
+	}
+	header.num_case = size();
+	header.num_basket_item = basket_item.size();
+	header.offset_user_id = alignOffset(sizeof(header));
+	header.offset_time_id = alignOffset(header.offset_user_id + header.num_case * sizeof(int));
+	header.offset_next_item = alignOffset(header.offset_time_id + header.num_case * sizeof(int));
+	header.offset_basket_offset = alignOffset(header.offset_next_item + header.num_case * sizeof(int));
+	header.offset_basket_item = alignOffset(header.offset_basket_offset + (header.num_case+1) * sizeof(long long));
+
+	// written under a temporary name and renamed, so concurrent readers never see a partial cache
+	std::string tmp_filename = cache_filename + ".tmp";
+	std::ofstream out_file (tmp_filename.c_str(), std::ios::out | std::ios::binary);
+	if (! out_file.is_open()) {
+		throw "Unable to open file " + tmp_filename;
+	}
+	out_file.write((const char*) &header, sizeof(header));
+	long long pos = sizeof(header);
+	writeAligned(out_file, pos, header.offset_user_id, user_id.value, header.num_case * sizeof(int));
+	writeAligned(out_file, pos, header.offset_time_id, time_id.value, header.num_case * sizeof(int));
+	writeAligned(out_file, pos, header.offset_next_item, next_item.value, header.num_case * sizeof(int));
+	writeAligned(out_file, pos, header.offset_basket_offset, basket_offset.value, (header.num_case+1) * sizeof(long long));
+	writeAligned(out_file, pos, header.offset_basket_item, basket_item.value, header.num_basket_item * sizeof(int));
+	out_file.close();
+	if (out_file.fail() || (rename(tmp_filename.c_str(), cache_filename.c_str()) != 0)) {
+		throw "Unable to write file " + cache_filename;
+	}
+}
+
+#endif /*BASKETCASEDB_H_*/
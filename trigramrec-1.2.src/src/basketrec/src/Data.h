@@ -18,29 +18,46 @@
 #include <math.h>
 #include <assert.h>
 
-#include "../../util/token_reader.h"
 #include "../../util/util.h"
 #include "../../util/matrix.h"
 #include "../../util/smatrix.h"
+#include "BasketCaseDB.h"
 
 
 class Dataset {
 	private:
 		void loadData(std::string filename);
 		void loadTest(std::string filename);
+		void loadCases(BasketCaseDB& cases, const std::string& filename);
 		
 	public:
 		// all data is stored in the order (user,time, item sequence)
-		SparseFourDimBoolean data;
-		SparseFourDimBoolean test_data;
-		SparseTensorBoolean test_baskets;
+		BasketCaseDB data;
+		BasketCaseDB test_data;
 		
 		int max_user_id, max_time_id, max_item_id;
+		// read/write a binary cache <filename>.cache next to every text file
+		bool use_cache;
+		// threads for parsing text files
+		int num_threads;
+		// the user and item ids of the files are raw ids mapped to the dense ids of users and items
+		bool remap_ids;
+		IdDictionary users, items;
 		
-		Dataset(std::string filename) {
+		// with p_users and p_items the raw ids are remapped: empty dictionaries number the
+		// users in order of appearance and the items by descending frequency in the training
+		// data; the ids of non-empty ones (e.g. of a model) are kept and unseen ids appended
+		Dataset(std::string filename, bool p_use_cache = false, int p_num_threads = 1, const IdDictionary* p_users = NULL, const IdDictionary* p_items = NULL) {
   			max_user_id = -1;
   			max_time_id = -1;
   			max_item_id = -1;
+			use_cache = p_use_cache;
+			num_threads = p_num_threads;
+			remap_ids = (p_users != NULL) && (p_items != NULL);
+			if (remap_ids) {
+				users = *p_users;
+				items = *p_items;
+			}
   			std::cout << "read data file " << filename << "..."; std::cout.flush();
 			loadData(filename); 		
 		}	
@@ -51,25 +68,47 @@ class Dataset {
 };
 
 
+void Dataset::loadCases(BasketCaseDB& cases, const std::string& filename) {
+	if (remap_ids) {
+		// the dense ids depend on the dictionaries, so they are not cached
+		cases.fromFile(filename, num_threads, &users, &items);
+		return;
+	}
+	if (! use_cache) {
+		cases.fromFile(filename, num_threads);
+		return;
+	}
+	std::string cache_filename = filename + ".cache";
+	if (cases.loadCache(cache_filename, filename)) {
+		std::cout << "(cached)";
+		return;
+	}
+	cases.fromFile(filename, num_threads);
+	cases.saveCache(cache_filename, filename);
+}
+
 void Dataset::loadData(std::string filename) {
-	data.fromFile(filename);
-	int num_baskets = 0;
-	//user
-	for(SparseFourDimBoolean::const_iterator t = data.begin(); t != data.end(); ++t) {
-		max_user_id = std::max(t->first, max_user_id);
-		//time	
-		for(SparseTensorBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-			max_time_id = std::max(i->first, max_time_id);
-			//item_n
-			for(SparseMatrixBoolean::const_iterator j = i->second.begin(); j != i->second.end(); ++j) {
-				max_item_id = std::max(j->first, max_item_id);
-				//item_n-1, item_n-2, ...
-				for(SparseVectorBoolean::const_iterator k = j->second.begin(); k != j->second.end(); ++k) {
-					max_item_id = std::max(*k, max_item_id);
-				}
-				num_baskets++;
-			}
+	bool is_new_numbering = remap_ids && items.empty();
+	loadCases(data, filename);
+	if (is_new_numbering) {
+		// popular items first: their factor rows share cache lines and pages
+		std::vector<long long> count(items.size(), 0);
+		for (int c = 0; c < data.size(); c++) {
+			count[data.next_item[c]]++;
+		}
+		for (size_t k = 0; k < data.basket_item.size(); k++) {
+			count[data.basket_item[k]]++;
 		}
+		data.renumberItems(items.orderByFrequency(count));
+	}
+	int num_baskets = data.size();
+	max_user_id = std::max(data.max_user_id, max_user_id);
+	max_time_id = std::max(data.max_time_id, max_time_id);
+	max_item_id = std::max(data.max_item_id, max_item_id);
+	if (remap_ids) {
+		// all ids of the dictionaries, also those of a model that are not in the data
+		max_user_id = std::max(users.size()-1, max_user_id);
+		max_item_id = std::max(items.size()-1, max_item_id);
 	}
 	
 	std::cout << std::endl;
@@ -80,48 +119,31 @@ void Dataset::loadData(std::string filename) {
 	
 }
 		
-//not sure how to store these testing information yet
+int countDistinct(std::vector<int> ids) {
+	std::sort(ids.begin(), ids.end());
+	return std::unique(ids.begin(), ids.end()) - ids.begin();
+}
+
 void Dataset::loadTest(std::string filename) {
-	test_data.fromFile(filename);
+	loadCases(test_data, filename);
 	
-	SparseSetBoolean test_users;
-	SparseSetBoolean test_times;
-	SparseSetBoolean test_items;
+	std::vector<int> test_users(test_data.user_id.begin(), test_data.user_id.end());
+	std::vector<int> test_times(test_data.time_id.begin(), test_data.time_id.end());
+	std::vector<int> test_items(test_data.next_item.begin(), test_data.next_item.end());
+	test_items.insert(test_items.end(), test_data.basket_item.begin(), test_data.basket_item.end());
 	
-	for(SparseFourDimBoolean::const_iterator t = test_data.begin(); t != test_data.end(); ++t) {
-		for(SparseTensorBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-			for(SparseMatrixBoolean::const_iterator j = i->second.begin(); j != i->second.end(); ++j) {
-				test_baskets[t->first][i->first] = j->second;
-			}
-		}
-	}
-	int num_baskets = 0;
-	//user	
-	for(SparseFourDimBoolean::const_iterator t = test_data.begin(); t != test_data.end(); ++t) {
-		test_users.insert(t->first);
-		max_user_id = std::max(t->first, max_user_id);	
-		//time	
-		for(SparseTensorBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-			test_times.insert(i->first);
-			max_time_id = std::max(i->first, max_time_id);
-			//item_n
-			for(SparseMatrixBoolean::const_iterator j = i->second.begin(); j != i->second.end(); ++j) {
-				test_items.insert(j->first);
-				test_items.insert(j->second.begin(), j->second.end());
-				max_item_id = std::max(j->first, max_item_id);
-				//item_n-1, ...
-				for(SparseVectorBoolean::const_iterator k = j->second.begin(); k != j->second.end(); ++k) {
-					max_item_id = std::max((*k), max_item_id);
-				}
-				num_baskets++;
-			}
-			// remove Assertion here
-		}
+	int num_baskets = test_data.size();
+	max_user_id = std::max(test_data.max_user_id, max_user_id);
+	max_time_id = std::max(test_data.max_time_id, max_time_id);
+	max_item_id = std::max(test_data.max_item_id, max_item_id);
+	if (remap_ids) {
+		max_user_id = std::max(users.size()-1, max_user_id);
+		max_item_id = std::max(items.size()-1, max_item_id);
 	}
 	std::cout << std::endl;
-  	std::cout << "number of test users        " << test_users.size() << std::endl;
-	std::cout << "number of test times        " << test_times.size() << std::endl;
-	std::cout << "number of test items         " << test_items.size() << std::endl;
+  	std::cout << "number of test users        " << countDistinct(test_users) << std::endl;
+	std::cout << "number of test times        " << countDistinct(test_times) << std::endl;
+	std::cout << "number of test items         " << countDistinct(test_items) << std::endl;
 	std::cout << "number of test baskets        " << num_baskets << std::endl;
 	
 	std::cout << std::endl;
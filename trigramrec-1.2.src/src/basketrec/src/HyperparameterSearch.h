@@ -0,0 +1,341 @@
+/*
+	Hyperparameter search for FPMC
+
+	grid:      every combination of the listed values
+	random:    num_trials configurations; a list is sampled uniformly, a range lo..hi log-uniformly
+	halving:   successive halving: num_trials random configurations are trained for min_iter
+	           iterations, the best 1/eta of them continue to eta times as many iterations,
+	           and so on up to max_iter
+	hyperband: successive halving brackets from many configurations with few iterations to
+	           few configurations with max_iter iterations, following
+	           Lisha Li, Kevin Jamieson, Giulia DeSalvo, Afshin Rostamizadeh, Ameet Talwalkar (2018): Hyperband: A Novel Bandit-Based Approach to Hyperparameter Optimization, Journal of Machine Learning Research 18.
+
+	All trials share one Dataset. They run concurrently, num_threads at a time with one
+	thread each; a stopped trial keeps its model so that it can continue later. The search
+	space is written as "dim=16|32|64;learn_rate=0.001..0.1;regular=0.001|0.01" where
+	"regular" sets all six regular_* values.
+*/
+
+#ifndef HYPERPARAMETERSEARCH_H_
+#define HYPERPARAMETERSEARCH_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <math.h>
+#include "../../util/random.h"
+#include "../../util/thread_pool.h"
+#include "basket_rec_fpmc.h"
+
+class SearchDimension {
+	public:
+		std::string name;
+		// the listed values, or the bounds of a range lower..upper
+		std::vector<double> values;
+		bool is_range;
+		double lower, upper;
+
+		double draw(Random& rng) const {
+			if (! is_range) {
+				return values[rng.bounded(values.size())];
+			}
+			if ((lower > 0) && (upper > 0)) {
+				return exp(log(lower) + rng.uniform() * (log(upper) - log(lower)));
+			}
+			return lower + rng.uniform() * (upper - lower);
+		}
+};
+
+class SearchTrial {
+	public:
+		std::vector<double> config;
+		uint64_t seed;
+		int num_iterations;
+		double mrr;
+		// alive while the trial may continue or is the best one
+		NextBasketRecommenderFPMC* model;
+		int num_rounds;
+
+		SearchTrial() { seed = 0; num_iterations = 0; mrr = -1; model = NULL; num_rounds = 0; }
+};
+
+class HyperparameterSearch {
+	private:
+		ThreadPool* pool;
+		std::mutex mutex;
+		// configurations and trial seeds; the workers reseed their ran_global per trial
+		Random rng;
+		int best_trial;
+
+		static bool isIntParameter(const std::string& name) {
+			return (! name.compare("dim")) || (! name.compare("num_sample"));
+		}
+
+		static bool isParameter(const std::string& name) {
+			const char* names[] = { "dim", "learn_rate", "init_stdev", "num_sample", "regular",
+				"regular_UI", "regular_IU", "regular_IL", "regular_LI", "regular_MI", "regular_IM" };
+			for (uint i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+				if (! name.compare(names[i])) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static void setParameter(NextBasketRecommenderFPMC& fpmc, const std::string& name, double value) {
+			if (! name.compare("dim")) { fpmc.num_feature = (int) value; }
+			else if (! name.compare("learn_rate")) { fpmc.learn_rate = value; }
+			else if (! name.compare("init_stdev")) { fpmc.init_stdev = value; }
+			else if (! name.compare("num_sample")) { fpmc.num_neg_samples = (int) value; }
+			else if (! name.compare("regular")) {
+				fpmc.regular_UI = fpmc.regular_IU = fpmc.regular_IL = fpmc.regular_LI = fpmc.regular_MI = fpmc.regular_IM = value;
+			}
+			else if (! name.compare("regular_UI")) { fpmc.regular_UI = value; }
+			else if (! name.compare("regular_IU")) { fpmc.regular_IU = value; }
+			else if (! name.compare("regular_IL")) { fpmc.regular_IL = value; }
+			else if (! name.compare("regular_LI")) { fpmc.regular_LI = value; }
+			else if (! name.compare("regular_MI")) { fpmc.regular_MI = value; }
+			else if (! name.compare("regular_IM")) { fpmc.regular_IM = value; }
+		}
+
+		void addGridConfigs(std::vector<double>& config, uint d) {
+			if (d == space.size()) {
+				addTrial(config);
+				return;
+			}
+			if (space[d].is_range) {
+				throw "grid search needs a list of values for " + space[d].name;
+			}
+			for (uint i = 0; i < space[d].values.size(); i++) {
+				config[d] = space[d].values[i];
+				addGridConfigs(config, d+1);
+			}
+		}
+
+		int addTrial(const std::vector<double>& config) {
+			SearchTrial trial;
+			trial.config = config;
+			trial.seed = rng.next();
+			trials.push_back(trial);
+			return trials.size() - 1;
+		}
+
+		std::vector<int> addRandomTrials(int n) {
+			std::vector<int> ids;
+			std::vector<double> config(space.size());
+			for (int t = 0; t < n; t++) {
+				for (uint d = 0; d < space.size(); d++) {
+					config[d] = space[d].draw(rng);
+				}
+				ids.push_back(addTrial(config));
+			}
+			return ids;
+		}
+
+		// keeps the model of trial t if it is the best so far, else frees it; call with the mutex held
+		void keepIfBest(int t) {
+			if ((best_trial >= 0) && (trials[best_trial].mrr >= trials[t].mrr)) {
+				delete trials[t].model;
+				trials[t].model = NULL;
+				return;
+			}
+			if ((best_trial >= 0) && (best_trial != t)) {
+				delete trials[best_trial].model;
+				trials[best_trial].model = NULL;
+			}
+			best_trial = t;
+		}
+
+		// trains every trial of ids up to num_iterations iterations; keep_models: the models stay
+		// alive for another round, else only the model of the best trial so far survives
+		void trainTrials(Dataset& dataset, const std::vector<int>& ids, int num_iterations, bool keep_models) {
+			std::atomic<int> next_trial(0);
+			pool->run([&](int thread_id) {
+				for (int i = next_trial++; i < (int) ids.size(); i = next_trial++) {
+					SearchTrial& trial = trials[ids[i]];
+					// the generator of every round is fixed by the trial, not by the schedule
+					ran_seed(Random(trial.seed, trial.num_rounds).next());
+					trial.num_rounds++;
+					if (trial.model == NULL) {
+						trial.model = create_model();
+						for (uint d = 0; d < space.size(); d++) {
+							setParameter(*trial.model, space[d].name, trial.config[d]);
+						}
+						trial.model->num_threads = 1;
+						trial.model->target_mrr = 0;
+						trial.model->patience = 0;
+						trial.model->keep_best = false;
+						trial.model->N = 10;
+						trial.model->init();
+					}
+					int num_new_iterations = num_iterations - trial.num_iterations;
+					if (num_new_iterations > 0) {
+						// one evaluation at the end of the round
+						trial.model->num_iterations = num_new_iterations;
+						trial.model->eval_every = num_new_iterations;
+						trial.mrr = trial.model->train(dataset);
+						trial.num_iterations = num_iterations;
+					}
+					std::lock_guard<std::mutex> lock(mutex);
+					if (! keep_models) {
+						keepIfBest(ids[i]);
+					}
+					std::cerr << "trial " << ids[i] << " " << configString(trial) << ": MRR " << trial.mrr << " after " << trial.num_iterations << " iterations" << std::endl;
+				}
+			});
+		}
+
+		// runs successive halving on ids starting with min_iterations iterations
+		void successiveHalving(Dataset& dataset, std::vector<int> ids, int min_iterations) {
+			int num_iterations = std::max(1, std::min(min_iterations, max_iter));
+			while (true) {
+				bool is_last = (num_iterations >= max_iter) || (ids.size() <= 1);
+				trainTrials(dataset, ids, num_iterations, ! is_last);
+				if (is_last) {
+					return;
+				}
+				std::stable_sort(ids.begin(), ids.end(), [this](int a, int b) { return trials[a].mrr > trials[b].mrr; });
+				int num_keep = std::max(1, (int) ids.size() / eta);
+				for (uint i = num_keep; i < ids.size(); i++) {
+					delete trials[ids[i]].model;
+					trials[ids[i]].model = NULL;
+				}
+				ids.resize(num_keep);
+				num_iterations = std::min(max_iter, num_iterations * eta);
+			}
+		}
+
+	public:
+		std::vector<SearchDimension> space;
+		std::vector<SearchTrial> trials;
+		// grid, random, halving or hyperband
+		std::string method;
+		int num_trials;
+		// iterations of a configuration in the first round of halving; the smallest budget of hyperband
+		int min_iter;
+		int max_iter;
+		// halving keeps the best 1/eta of the configurations of a round
+		int eta;
+		int num_threads;
+		// a new FPMC with the fixed hyperparameters; the search sets the searched ones and calls init()
+		std::function<NextBasketRecommenderFPMC*()> create_model;
+
+		HyperparameterSearch() {
+			pool = NULL;
+			best_trial = -1;
+			method = "halving";
+			num_trials = 27;
+			min_iter = 4;
+			max_iter = 100;
+			eta = 3;
+			num_threads = 1;
+		}
+		~HyperparameterSearch() {
+			for (uint t = 0; t < trials.size(); t++) {
+				delete trials[t].model;
+			}
+			delete pool;
+		}
+
+		void parseSpace(const std::string& spec) {
+			std::vector<std::string> dimensions = tokenize(spec, ";");
+			for (uint i = 0; i < dimensions.size(); i++) {
+				std::string::size_type eq = dimensions[i].find('=');
+				if (eq == std::string::npos) {
+					throw "search space: expected name=values in " + dimensions[i];
+				}
+				SearchDimension dimension;
+				dimension.name = dimensions[i].substr(0, eq);
+				std::string values = dimensions[i].substr(eq+1);
+				std::string::size_type dots = values.find("..");
+				dimension.is_range = (dots != std::string::npos);
+				if (dimension.is_range) {
+					dimension.lower = atof(values.substr(0, dots).c_str());
+					dimension.upper = atof(values.substr(dots+2).c_str());
+				} else {
+					std::vector<std::string> list = tokenize(values, "|");
+					for (uint j = 0; j < list.size(); j++) {
+						dimension.values.push_back(atof(list[j].c_str()));
+					}
+					if (dimension.values.size() == 0) {
+						throw "search space: no values for " + dimension.name;
+					}
+				}
+				if (dimension.is_range && isIntParameter(dimension.name)) {
+					throw "search space: " + dimension.name + " needs a list of values";
+				}
+				if (! isParameter(dimension.name)) {
+					throw "unknown search parameter " + dimension.name;
+				}
+				space.push_back(dimension);
+			}
+		}
+
+		// runs the search and returns the best trial; its model is trials[best].model
+		int run(Dataset& dataset) {
+			delete pool;
+			pool = new ThreadPool(num_threads);
+			rng.setSeed(ran_global().next());
+			best_trial = -1;
+			if (! method.compare("grid")) {
+				std::vector<double> config(space.size());
+				addGridConfigs(config, 0);
+				std::vector<int> ids(trials.size());
+				for (uint t = 0; t < ids.size(); t++) {
+					ids[t] = t;
+				}
+				trainTrials(dataset, ids, max_iter, false);
+			} else if (! method.compare("random")) {
+				trainTrials(dataset, addRandomTrials(num_trials), max_iter, false);
+			} else if (! method.compare("halving")) {
+				successiveHalving(dataset, addRandomTrials(num_trials), min_iter);
+			} else if (! method.compare("hyperband")) {
+				int s_max = 0;
+				while ((long long) min_iter * eta * pow((double) eta, s_max) <= max_iter) {
+					s_max++;
+				}
+				for (int s = s_max; s >= 0; s--) {
+					int n = (int) ceil((double) (s_max + 1) / (s + 1) * pow((double) eta, s));
+					int r = std::max(1, (int) (max_iter / pow((double) eta, s)));
+					std::cerr << "Hyperband bracket " << s_max - s << ": " << n << " configurations from " << r << " iterations" << std::endl;
+					successiveHalving(dataset, addRandomTrials(n), r);
+				}
+			} else {
+				throw "unknown search method " + method;
+			}
+			return best_trial;
+		}
+
+		std::string configString(const SearchTrial& trial) const {
+			std::ostringstream s;
+			for (uint d = 0; d < space.size(); d++) {
+				s << (d > 0 ? " " : "") << "-" << space[d].name << " ";
+				if (isIntParameter(space[d].name)) {
+					s << (int) trial.config[d];
+				} else {
+					s << trial.config[d];
+				}
+			}
+			return s.str();
+		}
+
+		// all trials, best first
+		void report(std::ostream& out) const {
+			std::vector<int> order(trials.size());
+			for (uint t = 0; t < order.size(); t++) {
+				order[t] = t;
+			}
+			std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return trials[a].mrr > trials[b].mrr; });
+			out << "trial\titerations\tMRR\tconfiguration" << std::endl;
+			for (uint i = 0; i < order.size(); i++) {
+				const SearchTrial& trial = trials[order[i]];
+				out << order[i] << "\t" << trial.num_iterations << "\t" << trial.mrr << "\t" << configString(trial) << std::endl;
+			}
+		}
+};
+
+#endif /*HYPERPARAMETERSEARCH_H_*/
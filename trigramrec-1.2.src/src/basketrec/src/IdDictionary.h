@@ -0,0 +1,135 @@
+/*
+	Dense ids for raw user and item ids
+
+	A raw id is any whitespace free token of a data file (a number or a
+	string). add() gives every new token the next dense id and name() maps a
+	dense id back to its token. orderByFrequency() renumbers the ids by
+	descending count, so the factor rows of popular items are next to each
+	other in memory.
+*/
+
+#ifndef IDDICTIONARY_H_
+#define IDDICTIONARY_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <climits>
+
+class IdDictionary {
+	private:
+		std::unordered_map<std::string, int> index;
+		// raw id of every dense id
+		std::vector<std::string> names;
+	public:
+		int size() const { return names.size(); }
+		bool empty() const { return names.empty(); }
+
+		void clear() {
+			index.clear();
+			names.clear();
+		}
+
+		// the dense id of name; a new name gets the next id
+		int add(const std::string& name) {
+			std::unordered_map<std::string, int>::const_iterator iter = index.find(name);
+			if (iter != index.end()) {
+				return iter->second;
+			}
+			int id = names.size();
+			index[name] = id;
+			names.push_back(name);
+			return id;
+		}
+
+		// the dense id of name or -1 if it is unknown
+		int find(const std::string& name) const {
+			std::unordered_map<std::string, int>::const_iterator iter = index.find(name);
+			return (iter != index.end()) ? iter->second : -1;
+		}
+
+		const std::string& name(int id) const { return names[id]; }
+
+		// the raw id as an integer (for the binary prediction file)
+		int numericName(int id) const {
+			const char* begin = names[id].c_str();
+			char* end;
+			long long value = strtoll(begin, &end, 10);
+			if ((end == begin) || (*end != 0) || (value < INT_MIN) || (value > INT_MAX)) {
+				throw "the raw id " + names[id] + " is not an integer";
+			}
+			return value;
+		}
+
+		// position of every dense id when the raw ids are sorted: integers numerically, then the
+		// other raw ids as strings (the order of the raw ids in a file read without remapping)
+		std::vector<int> rankByName() const {
+			std::vector<long long> value(names.size());
+			std::vector<bool> is_number(names.size());
+			for (uint i = 0; i < names.size(); i++) {
+				const char* begin = names[i].c_str();
+				char* end;
+				value[i] = strtoll(begin, &end, 10);
+				is_number[i] = (end != begin) && (*end == 0);
+			}
+			std::vector<int> order(names.size());
+			for (uint i = 0; i < order.size(); i++) {
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&](int a, int b) {
+				if (is_number[a] != is_number[b]) { return (bool) is_number[a]; }
+				if (is_number[a] && (value[a] != value[b])) { return value[a] < value[b]; }
+				return names[a] < names[b];
+			});
+			std::vector<int> rank(names.size());
+			for (uint i = 0; i < order.size(); i++) {
+				rank[order[i]] = i;
+			}
+			return rank;
+		}
+
+		// renumbers the ids by descending count (ties keep the current order); returns new_id[old id]
+		std::vector<int> orderByFrequency(const std::vector<long long>& count) {
+			std::vector<int> order(names.size());
+			for (uint i = 0; i < order.size(); i++) {
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+				return count[a] > count[b];
+			});
+			std::vector<int> new_id(names.size());
+			std::vector<std::string> new_names(names.size());
+			for (uint i = 0; i < order.size(); i++) {
+				new_id[order[i]] = i;
+				new_names[i].swap(names[order[i]]);
+				index[new_names[i]] = i;
+			}
+			names.swap(new_names);
+			return new_id;
+		}
+
+		// one raw id per line in the order of the dense ids
+		void write(std::string& out) const {
+			for (uint i = 0; i < names.size(); i++) {
+				out += names[i];
+				out += '\n';
+			}
+		}
+		// reads num_ids lines of write() from [p, end) and moves p behind them; false if there are fewer
+		bool read(const char*& p, const char* end, int num_ids) {
+			clear();
+			for (int i = 0; i < num_ids; i++) {
+				const char* line_end = std::find(p, end, '\n');
+				if (line_end == end) {
+					return false;
+				}
+				add(std::string(p, line_end));
+				p = line_end + 1;
+			}
+			return true;
+		}
+};
+
+#endif /*IDDICTIONARY_H_*/
@@ -0,0 +1,222 @@
+/*
+	Approximate maximum-inner-product search with an inverted file
+
+	The item vectors x are augmented to x' = [x, sqrt(M^2 - |x|^2)] with M the
+	largest item norm, and queries to q' = [q, 0]. Then <q,x> is maximal iff
+	|q'-x'| is minimal, so the items can be clustered with k-means. A query
+	scores only the items of the num_probe clusters whose centroids are
+	closest to q' and keeps the N best of them.
+
+	Based on the publication(s):
+	Yoram Bachrach et al. (2014): Speeding Up the Xbox Recommender System Using a Euclidean Transformation for Inner-Product Spaces, in Proceedings of the 8th ACM Conference on Recommender Systems (RecSys 2014)
+*/
+
+#ifndef MIPSINDEX_H_
+#define MIPSINDEX_H_
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include "../../util/thread_pool.h"
+#include "../../util/random.h"
+#include "NextBasketRecommender.h"
+#include "ScoringKernel.h"
+
+class MIPSIndexIVF {
+	private:
+		int dim;
+		int num_items;
+		int num_clusters;
+		// centroids over the augmented space, dim+1 values per cluster
+		std::vector<double> centroid;
+		std::vector<double> centroid_sqnorm;
+		// items grouped by cluster: vectors of cluster k are rows cluster_offset[k]..cluster_offset[k+1]
+		std::vector<int> cluster_offset;
+		std::vector<int> item_id;
+		std::vector<double> vectors;
+
+		inline double augmentedDistance(const double* x, double x_extra, int k) const {
+			const double* c = &centroid[(long long) k * (dim+1)];
+			double d = 0;
+			for (int f = 0; f < dim; f++) {
+				d += (x[f] - c[f]) * (x[f] - c[f]);
+			}
+			return d + (x_extra - c[dim]) * (x_extra - c[dim]);
+		}
+
+	public:
+		int num_probe;
+		std::atomic<long long> num_queries;
+		std::atomic<long long> num_scanned;
+
+		MIPSIndexIVF() {
+			dim = 0;
+			num_items = 0;
+			num_clusters = 0;
+			num_probe = 1;
+			num_queries = 0;
+			num_scanned = 0;
+		}
+
+		bool isBuilt() const { return num_clusters > 0; }
+
+		// builds the index over items[i*item_stride .. +p_dim) for i < p_num_items
+		void build(const double* items, int p_num_items, int item_stride, int p_dim, int p_num_clusters, int num_kmeans_iter, ThreadPool& pool);
+
+		// writes the (approximately) n best items for query into top, best first; scores is scratch of num_items
+		int query(const double* q, WeightedItem* top, int n, double* scores);
+};
+
+
+void MIPSIndexIVF::build(const double* items, int p_num_items, int item_stride, int p_dim, int p_num_clusters, int num_kmeans_iter, ThreadPool& pool) {
+	dim = p_dim;
+	num_items = p_num_items;
+	num_clusters = std::max(1, std::min(p_num_clusters, num_items));
+	num_queries = 0;
+	num_scanned = 0;
+
+	// Euclidean transformation
+	std::vector<double> extra(num_items);
+	double max_sqnorm = 0;
+	for (int i = 0; i < num_items; i++) {
+		const double* x = items + (long long) i * item_stride;
+		double sqnorm = 0;
+		for (int f = 0; f < dim; f++) {
+			sqnorm += x[f] * x[f];
+		}
+		extra[i] = sqnorm;
+		max_sqnorm = std::max(max_sqnorm, sqnorm);
+	}
+	for (int i = 0; i < num_items; i++) {
+		extra[i] = sqrt(std::max(0.0, max_sqnorm - extra[i]));
+	}
+
+	// k-means, initialised with distinct random items
+	std::vector<int> perm(num_items);
+	for (int i = 0; i < num_items; i++) {
+		perm[i] = i;
+	}
+	for (int k = 0; k < num_clusters; k++) {
+		std::swap(perm[k], perm[k + ran_global().bounded(num_items - k)]);
+	}
+	centroid.assign((long long) num_clusters * (dim+1), 0.0);
+	for (int k = 0; k < num_clusters; k++) {
+		const double* x = items + (long long) perm[k] * item_stride;
+		std::copy(x, x+dim, &centroid[(long long) k * (dim+1)]);
+		centroid[(long long) k * (dim+1) + dim] = extra[perm[k]];
+	}
+	std::vector<int> assignment(num_items, 0);
+	for (int iter = 0; iter <= num_kmeans_iter; iter++) {
+		pool.run([&](int thread_id) {
+			int i_end = pool.rangeBegin(num_items, thread_id+1);
+			for (int i = pool.rangeBegin(num_items, thread_id); i < i_end; i++) {
+				const double* x = items + (long long) i * item_stride;
+				double best = augmentedDistance(x, extra[i], 0);
+				assignment[i] = 0;
+				for (int k = 1; k < num_clusters; k++) {
+					double d = augmentedDistance(x, extra[i], k);
+					if (d < best) {
+						best = d;
+						assignment[i] = k;
+					}
+				}
+			}
+		});
+		if (iter == num_kmeans_iter) {
+			break;
+		}
+		std::vector<double> sum((long long) num_clusters * (dim+1), 0.0);
+		std::vector<int> count(num_clusters, 0);
+		for (int i = 0; i < num_items; i++) {
+			const double* x = items + (long long) i * item_stride;
+			double* s = &sum[(long long) assignment[i] * (dim+1)];
+			for (int f = 0; f < dim; f++) {
+				s[f] += x[f];
+			}
+			s[dim] += extra[i];
+			count[assignment[i]]++;
+		}
+		for (int k = 0; k < num_clusters; k++) {
+			// empty clusters keep their old centroid
+			if (count[k] > 0) {
+				for (int f = 0; f <= dim; f++) {
+					centroid[(long long) k * (dim+1) + f] = sum[(long long) k * (dim+1) + f] / count[k];
+				}
+			}
+		}
+	}
+
+	// lay the items out cluster by cluster
+	cluster_offset.assign(num_clusters+1, 0);
+	for (int i = 0; i < num_items; i++) {
+		cluster_offset[assignment[i]+1]++;
+	}
+	for (int k = 0; k < num_clusters; k++) {
+		cluster_offset[k+1] += cluster_offset[k];
+	}
+	std::vector<int> fill(cluster_offset.begin(), cluster_offset.end()-1);
+	item_id.resize(num_items);
+	vectors.resize((long long) num_items * dim);
+	for (int i = 0; i < num_items; i++) {
+		int row = fill[assignment[i]]++;
+		item_id[row] = i;
+		std::copy(items + (long long) i * item_stride, items + (long long) i * item_stride + dim, &vectors[(long long) row * dim]);
+	}
+	centroid_sqnorm.resize(num_clusters);
+	for (int k = 0; k < num_clusters; k++) {
+		double sqnorm = 0;
+		for (int f = 0; f <= dim; f++) {
+			sqnorm += centroid[(long long) k * (dim+1) + f] * centroid[(long long) k * (dim+1) + f];
+		}
+		centroid_sqnorm[k] = sqnorm;
+	}
+}
+
+int MIPSIndexIVF::query(const double* q, WeightedItem* top, int n, double* scores) {
+	// closest centroids to q' = [q, 0]: largest <q,c> - |c|^2/2
+	int probe = std::min(num_probe, num_clusters);
+	std::vector<WeightedItem> cluster(num_clusters);
+	std::vector<double> closeness(num_clusters);
+	scoreItems(q, 1, dim, &centroid[0], num_clusters, dim+1, dim, &closeness[0], num_clusters);
+	for (int k = 0; k < num_clusters; k++) {
+		closeness[k] -= 0.5 * centroid_sqnorm[k];
+	}
+	int num_selected = selectTopItems(&closeness[0], num_clusters, &cluster[0], probe);
+
+	// exact scores for the items of the probed clusters; scores is indexed by row
+	int num_candidates = 0;
+	for (int j = 0; j < num_selected; j++) {
+		int k = cluster[j].item_id;
+		int row_begin = cluster_offset[k];
+		int row_end = cluster_offset[k+1];
+		scoreItemRange(q, &vectors[0], dim, row_begin, row_end, dim, scores);
+		num_candidates += row_end - row_begin;
+	}
+
+	// bounded heap over the candidates, same ranking order as selectTopItems
+	int num_top = 0;
+	for (int j = 0; j < num_selected; j++) {
+		int k = cluster[j].item_id;
+		for (int row = cluster_offset[k]; row < cluster_offset[k+1]; row++) {
+			WeightedItem candidate;
+			candidate.item_id = item_id[row];
+			candidate.weight = scores[row];
+			if (num_top < n) {
+				top[num_top++] = candidate;
+				std::push_heap(top, top+num_top, isRankedBefore);
+			} else if (isRankedBefore(candidate, top[0])) {
+				std::pop_heap(top, top+n, isRankedBefore);
+				top[n-1] = candidate;
+				std::push_heap(top, top+n, isRankedBefore);
+			}
+		}
+	}
+	std::sort_heap(top, top+num_top, isRankedBefore);
+
+	num_queries++;
+	num_scanned += num_candidates;
+	return num_top;
+}
+
+#endif /*MIPSINDEX_H_*/
@@ -0,0 +1,181 @@
+/*
+	Negative item samplers for BPR
+
+	uniform:  every item except the positive one with the same probability
+	pop:      items proportional to how often they occur as next item (alias table)
+	adaptive: context-dependent oversampling of items that the current model
+	          ranks high for (user, last items), following
+	          Steffen Rendle, Christoph Freudenthaler (2014): Improving Pairwise Learning for Item Recommendation from Implicit Feedback, in Proceedings of the 7th ACM International Conference on Web Search and Data Mining (WSDM 2014), ACM.
+
+	draw() is called concurrently by all training threads; refresh() is called
+	between rounds of draws while no thread is drawing.
+*/
+
+#ifndef NEGATIVESAMPLER_H_
+#define NEGATIVESAMPLER_H_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "../../util/random.h"
+#include "BasketCaseDB.h"
+#include "NextBasketRecommender.h"
+
+class NegativeSampler {
+	protected:
+		int num_item;
+	public:
+		NegativeSampler() { num_item = 0; }
+		virtual ~NegativeSampler() {}
+
+		virtual void init(const BasketCaseDB& data, int p_num_item) { num_item = p_num_item; }
+		// number of draws after which refresh() has to be called; 0 = never
+		virtual long long refreshInterval() { return 0; }
+		virtual void refresh(NextBasketRecommender& rec) {}
+		// an item != nextitem_positive
+		virtual int draw(Random& rng, int user_id, int nextitem_positive, const BasketRef& basket) = 0;
+};
+
+class NegativeSamplerUniform : public NegativeSampler {
+	public:
+		virtual int draw(Random& rng, int user_id, int nextitem_positive, const BasketRef& basket) {
+			int nextitem_negative;
+			do {
+				nextitem_negative = rng.bounded(num_item);
+			} while (nextitem_negative == nextitem_positive);
+			return nextitem_negative;
+		}
+};
+
+class NegativeSamplerPopularity : public NegativeSampler {
+	private:
+		AliasTable table;
+		NegativeSamplerUniform uniform;
+	public:
+		virtual void init(const BasketCaseDB& data, int p_num_item) {
+			NegativeSampler::init(data, p_num_item);
+			uniform.init(data, p_num_item);
+			std::vector<double> count(num_item, 0.0);
+			for (int c = 0; c < data.size(); c++) {
+				count[data.next_item[c]]++;
+			}
+			table.build(count);
+		}
+
+		virtual int draw(Random& rng, int user_id, int nextitem_positive, const BasketRef& basket) {
+			// a bounded number of tries: the positive may hold most of the mass
+			for (int i = 0; i < 16; i++) {
+				int nextitem_negative = table.draw(rng);
+				if (nextitem_negative != nextitem_positive) {
+					return nextitem_negative;
+				}
+			}
+			return uniform.draw(rng, user_id, nextitem_positive, basket);
+		}
+};
+
+class NegativeSamplerAdaptive : public NegativeSampler {
+	private:
+		NextBasketRecommender* rec;
+		int dim;
+		// ranking[f*num_item + r] = item with the r-th largest value in factor f
+		std::vector<int> ranking;
+		std::vector<double> factor_stdev;
+		NegativeSamplerUniform uniform;
+	public:
+		// mean of the geometric rank distribution, relative to the number of items
+		double lambda;
+
+		NegativeSamplerAdaptive() { rec = NULL; dim = 0; lambda = 0.1; }
+
+		virtual void init(const BasketCaseDB& data, int p_num_item) {
+			NegativeSampler::init(data, p_num_item);
+			uniform.init(data, p_num_item);
+		}
+
+		// the paper recomputes the rankings every |I| log |I| draws
+		virtual long long refreshInterval() {
+			return std::max(1LL, (long long) (num_item * log((double) std::max(num_item, 2))));
+		}
+
+		virtual void refresh(NextBasketRecommender& p_rec) {
+			rec = &p_rec;
+			dim = rec->factorDim();
+			if (dim == 0) {
+				throw std::string("the adaptive sampler needs a factorization method");
+			}
+			rec->prepareScoring();
+			const double* items = rec->itemFactors();
+			ranking.resize((long long) dim * num_item);
+			factor_stdev.assign(dim, 0.0);
+			ThreadPool& pool = rec->threadPool();
+			pool.run([&](int thread_id) {
+				int f_end = pool.rangeBegin(dim, thread_id+1);
+				for (int f = pool.rangeBegin(dim, thread_id); f < f_end; f++) {
+					int* rank = &ranking[(long long) f * num_item];
+					double sum = 0, sum_sq = 0;
+					for (int i = 0; i < num_item; i++) {
+						rank[i] = i;
+						double v = items[(long long) i * dim + f];
+						sum += v;
+						sum_sq += v * v;
+					}
+					double mean = sum / num_item;
+					factor_stdev[f] = sqrt(std::max(0.0, sum_sq / num_item - mean * mean));
+					std::sort(rank, rank + num_item, [&](int a, int b) {
+						return items[(long long) a * dim + f] > items[(long long) b * dim + f];
+					});
+				}
+			});
+		}
+
+		virtual int draw(Random& rng, int user_id, int nextitem_positive, const BasketRef& basket) {
+			static thread_local std::vector<double> query, weight;
+			query.resize(dim);
+			weight.resize(dim);
+			rec->buildQuery(user_id, basket, &query[0]);
+			// factor f with p(f|c) ~ |q_f| * stdev_f
+			double sum = 0;
+			for (int f = 0; f < dim; f++) {
+				weight[f] = fabs(query[f]) * factor_stdev[f];
+				sum += weight[f];
+			}
+			if (! (sum > 0)) {
+				return uniform.draw(rng, user_id, nextitem_positive, basket);
+			}
+			for (int i = 0; i < 16; i++) {
+				double x = rng.uniform() * sum;
+				int f = 0;
+				while ((f < dim-1) && (x >= weight[f])) {
+					x -= weight[f];
+					f++;
+				}
+				// rank r ~ exp(-r / (lambda * num_item)), from the top of the ranking if q_f > 0 else from the bottom
+				long long r = (long long) (-lambda * num_item * log(1.0 - rng.uniform()));
+				if (r >= num_item) {
+					continue;
+				}
+				int nextitem_negative = (query[f] > 0) ? ranking[(long long) f * num_item + r] : ranking[(long long) f * num_item + num_item - 1 - r];
+				if (nextitem_negative != nextitem_positive) {
+					return nextitem_negative;
+				}
+			}
+			return uniform.draw(rng, user_id, nextitem_positive, basket);
+		}
+};
+
+NegativeSampler* createNegativeSampler(const std::string& name, double lambda) {
+	if (! name.compare("uniform")) {
+		return new NegativeSamplerUniform();
+	} else if (! name.compare("pop")) {
+		return new NegativeSamplerPopularity();
+	} else if (! name.compare("adaptive")) {
+		NegativeSamplerAdaptive* sampler = new NegativeSamplerAdaptive();
+		sampler->lambda = lambda;
+		return sampler;
+	}
+	throw "unknown sampler " + name;
+}
+
+#endif /*NEGATIVESAMPLER_H_*/
@@ -11,8 +11,30 @@
 #define NEXTBASKETRECOMMENDER_H_
 
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <math.h>
+#include <atomic>
+#include <cstring>
+#include "../../util/thread_pool.h"
+#include "../../util/random.h"
+#include "../../util/fast_format.h"
+#include "../../util/ordered_writer.h"
+#include "IdDictionary.h"
+
+// binary top-N file (savePrediction with binary=true): this header, then num_rows records
+// {int32 user_id, int32 time_id, int32 num_top, num_top_max x {int32 item_id, float score}}
+// with the items best first; unused entries have item_id -1. With id dictionaries the
+// records hold the raw ids, which then have to be integers
+const char TOPN_FILE_MAGIC[8] = { 'F', 'P', 'M', 'C', 'T', 'O', 'P', 'N' };
+const int TOPN_FILE_VERSION = 1;
+
+struct TopNFileHeader {
+	char magic[8];
+	int version;
+	int num_top_max;
+	long long num_rows;
+};
 
 struct WeightedItem {
 	int item_id;
@@ -23,113 +45,414 @@ bool operator<(const WeightedItem& a, const WeightedItem& b) {
     return a.weight < b.weight;
 }
 
+// ranking order of the top-N lists: higher weight first, ties broken by the smaller item id
+inline bool isRankedBefore(const WeightedItem& a, const WeightedItem& b) {
+	return (a.weight > b.weight) || ((a.weight == b.weight) && (a.item_id < b.item_id));
+}
+
+// selects the n best of scores[0..num_items) with a bounded heap; top[0..result) is sorted best first
+int selectTopItems(const double* scores, int num_items, WeightedItem* top, int n) {
+	n = std::min(n, num_items);
+	if (n <= 0) {
+		return 0;
+	}
+	// top[0] is the worst item kept so far
+	for (int i = 0; i < n; i++) {
+		top[i].item_id = i;
+		top[i].weight = scores[i];
+		if (isnan(scores[i])) {
+			throw "Prediction is NAN";
+		}
+	}
+	std::make_heap(top, top+n, isRankedBefore);
+	for (int i = n; i < num_items; i++) {
+		if (scores[i] > top[0].weight) {
+			std::pop_heap(top, top+n, isRankedBefore);
+			top[n-1].item_id = i;
+			top[n-1].weight = scores[i];
+			std::push_heap(top, top+n, isRankedBefore);
+		} else if (isnan(scores[i])) {
+			throw "Prediction is NAN";
+		}
+	}
+	std::sort_heap(top, top+n, isRankedBefore);
+	return n;
+}
+
 
 class NextBasketRecommender {
+	private:
+		ThreadPool* pool;
 	public:
-		NextBasketRecommender() { N = 10; }
+		NextBasketRecommender() { N = 10; num_threads = 1; pool = NULL; }
+		virtual ~NextBasketRecommender() {
+			if (pool != NULL) {
+				delete pool;
+			}
+		}
 
 		int N;
+		int num_threads;
+		// raw ids of the dense user and item ids, used for the output; empty: the ids are the raw ids
+		IdDictionary user_ids, item_ids;
+
+		// worker threads shared by training and evaluation; created on first use
+		ThreadPool& threadPool() {
+			if ((pool == NULL) || (pool->num_threads != std::max(num_threads, 1))) {
+				if (pool != NULL) {
+					delete pool;
+				}
+				pool = new ThreadPool(num_threads);
+			}
+			return *pool;
+		}
+		// in a forked child: the worker threads of the pool exist only in the parent, so the pool
+		// is dropped without joining them and threadPool() starts a new one
+		void detachThreadPool() {
+			pool = NULL;
+		}
 		
 		// abstract methods to be implemented in base class
 		virtual double train(Dataset& dataset) = 0;
-		virtual double predict(int user_id, int time_id, int nextitem_id, const SparseVectorBoolean* basket) = 0;
+		virtual double predict(int user_id, int time_id, int nextitem_id, const BasketRef& basket) = 0;
 
 		// implemented methods by NextBasketRecommender
 		double evaluate(Dataset* dataset);
-		virtual void predictTopItems(int user_id, int time_id, WeightedItem* items, int num_items, const SparseVectorBoolean* basket);
+		// MRR@N where each test row is ranked against num_sampled random negatives instead of all items
+		double evaluateSampled(Dataset* dataset, int num_sampled, uint64_t seed);
+		// keeps a copy of the parameters in memory / writes it back
+		virtual void saveSnapshot() { throw std::string("this method does not support snapshots"); };
+		virtual void restoreSnapshot() {};
+		// called before a round of predictScores() once the parameters have changed
+		virtual void prepareScoring() {};
+		// scores[i] = predict(user_id, time_id, i, basket) for all items i < num_items; must be thread-safe
+		virtual void predictScores(int user_id, int time_id, const BasketRef& basket, double* scores, int num_items);
+		// writes the n best items into top, best first; scores is scratch space for num_items values
+		virtual int predictTopItems(int user_id, int time_id, const BasketRef& basket, int num_items, WeightedItem* top, int n, double* scores);
+		// the same for a micro-batch of queries: query q uses scores[q*num_items..], top[q*n..] and num_top[q]
+		virtual void predictScoresBatch(const int* user_ids, const BasketRef* baskets, int num_queries, double* scores, int num_items);
+		virtual void predictTopItemsBatch(const int* user_ids, const BasketRef* baskets, int num_queries, int num_items, WeightedItem* top, int n, int* num_top, double* scores);
+		// approximate top-N retrieval used by predictTopItems once built
+		virtual void buildIndex(int num_clusters, int num_probe) { throw std::string("this method does not support a retrieval index"); };
+		virtual void reportIndex(Dataset* dataset);
+		// factorized view for the adaptive sampler: predict(u,t,i,basket) = <query, itemFactors() row i>,
+		// rows of factorDim() values, valid after prepareScoring(); factorDim() == 0 if there is no such view
+		virtual int factorDim() { return 0; }
+		virtual void buildQuery(int user_id, const BasketRef& basket, double* query) {};
+		virtual const double* itemFactors() { return NULL; }
 		virtual void saveModel(std::string filename) {};	
 		virtual void loadModel(std::string filename) {};	
-		virtual SparseTensorDouble testpredict(SparseTensorBoolean& baskets, int num_items, int max_items_per_basket_out);
-		void savePrediction(SparseTensorBoolean& baskets, const std::string& filename, int num_items, int max_items_per_basket_out);
-		inline virtual void learn(int user_id, int time_id, int nextitem_p, int nextitem_n, const SparseVectorBoolean* basket) {};
+		virtual SparseTensorDouble testpredict(const BasketCaseDB& cases, int num_items, int max_items_per_basket_out);
+		// writes the top max_items_per_basket_out items of the last case of every (user, time): as text lines
+		// "user time item score" in item order, or in the binary top-N format; the rows are scored in parallel
+		void savePrediction(const BasketCaseDB& cases, const std::string& filename, int num_items, int max_items_per_basket_out, bool binary = false);
+		inline virtual void learn(int user_id, int time_id, int nextitem_p, int nextitem_n, const BasketRef& basket) {};
+		// SGD steps for one case and several negatives; a model can share the work on the case between them
+		virtual void learnNegatives(int user_id, int time_id, int nextitem_p, const int* nextitem_n, int num_negatives, const BasketRef& basket) {
+			for (int j = 0; j < num_negatives; j++) {
+				learn(user_id, time_id, nextitem_p, nextitem_n[j], basket);
+			}
+		}
 		virtual void auto_save(int iteration) {};
 };
 
 double NextBasketRecommender::evaluate(Dataset* dataset) {
 
-	int num_baskets = 0;
 	int num_items = dataset->max_item_id+1;
-	double avg_mrr = 0;	
+	const BasketCaseDB& test_data = dataset->test_data;
+	int num_baskets = test_data.size();
+	
+	// reciprocal rank per test row; summed in row order so the result does not depend on num_threads
+	std::vector<double> reciprocal_rank(num_baskets, 0.0);
+	std::atomic<int> next_row(0);
+	const int ROWS_PER_CHUNK = 16;
 	
-	WeightedItem* weighted_item = new WeightedItem[num_items];
-	//user
-	for(SparseFourDimBoolean::const_iterator u = dataset->test_data.begin(); u != dataset->test_data.end(); ++u) {
-		//time
-		for(SparseTensorBoolean::const_iterator t = u->second.begin(); t != u->second.end(); ++t) {
-			//seq
-			for(SparseMatrixBoolean::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
-				int user_id = u->first;
-				int time_id = t->first;
-				int answer_item_id = i->first;
-				const SparseVectorBoolean* basket = & (i->second);
+	prepareScoring();
+	threadPool().run([&](int thread_id) {
+		std::vector<double> scores(num_items);
+		std::vector<WeightedItem> top(N);
+		while (true) {
+			int chunk_begin = next_row.fetch_add(ROWS_PER_CHUNK);
+			if (chunk_begin >= num_baskets) {
+				break;
+			}
+			int chunk_end = std::min(chunk_begin + ROWS_PER_CHUNK, num_baskets);
+			for (int c = chunk_begin; c < chunk_end; c++) {
+				int user_id = test_data.user_id[c];
+				int time_id = test_data.time_id[c];
+				int answer_item_id = test_data.next_item[c];
 				// evaluate on (user_id, time_id, basket)
-				for (int j = 0; j < num_items; j++) {
-					weighted_item[j].item_id = j;
-				}
-				predictTopItems(user_id, time_id, weighted_item, num_items, basket);
-
-				// sort
-				std::sort(weighted_item, weighted_item+num_items);
-				// evaluate F1-Measure
-				for (int t = 0; t < N; t++) {
+				int num_top = predictTopItems(user_id, time_id, test_data.basket(c), num_items, &top[0], N, &scores[0]);
+				for (int t = 0; t < num_top; t++) {
 					// look if this item is in the users tag list
-					if (weighted_item[num_items-t-1].item_id == answer_item_id) {
-						avg_mrr += 1.0/(double)(t+1);
+					if (top[t].item_id == answer_item_id) {
+						reciprocal_rank[c] = 1.0/(double)(t+1);
 						break;
 					}
 				}
-				
-				num_baskets++;
 			}
 		}
-	}
+	});
 	
-	avg_mrr /= (double)num_baskets;
+	double avg_mrr = 0;	
+	for (int c = 0; c < num_baskets; c++) {
+		avg_mrr += reciprocal_rank[c];
+	}
+	if (num_baskets > 0) {
+		avg_mrr /= (double)num_baskets;
+	}
   	std::cout << std::endl;
 	
-	delete [] weighted_item;
-	
 	return avg_mrr;
 }
 
 
-void NextBasketRecommender::predictTopItems(int user_id, int time_id, WeightedItem* items, int num_items, const SparseVectorBoolean* basket) {
+double NextBasketRecommender::evaluateSampled(Dataset* dataset, int num_sampled, uint64_t seed) {
+	int num_items = dataset->max_item_id+1;
+	const BasketCaseDB& test_data = dataset->test_data;
+	int num_baskets = test_data.size();
+
+	// row c draws its negatives from stream (seed, c), so the sample does not depend on num_threads
+	std::vector<double> reciprocal_rank(num_baskets, 0.0);
+	ThreadPool& pool = threadPool();
+	pool.run([&](int thread_id) {
+		int c_end = pool.rangeBegin(num_baskets, thread_id+1);
+		for (int c = pool.rangeBegin(num_baskets, thread_id); c < c_end; c++) {
+			int user_id = test_data.user_id[c];
+			int time_id = test_data.time_id[c];
+			int answer_item_id = test_data.next_item[c];
+			BasketRef basket = test_data.basket(c);
+			WeightedItem answer;
+			answer.item_id = answer_item_id;
+			answer.weight = predict(user_id, time_id, answer_item_id, basket);
+			Random rng(seed, c);
+			int rank = 1;
+			// a catalogue of only the answer has no negatives to draw
+			int num_sampled_c = ((num_items > 1) || ((num_items == 1) && (answer_item_id != 0))) ? num_sampled : 0;
+			for (int j = 0; (j < num_sampled_c) && (rank <= N); j++) {
+				WeightedItem negative;
+				do {
+					negative.item_id = rng.bounded(num_items);
+				} while (negative.item_id == answer_item_id);
+				negative.weight = predict(user_id, time_id, negative.item_id, basket);
+				if (isRankedBefore(negative, answer)) {
+					rank++;
+				}
+			}
+			if (rank <= N) {
+				reciprocal_rank[c] = 1.0/(double)rank;
+			}
+		}
+	});
+
+	double avg_mrr = 0;
+	for (int c = 0; c < num_baskets; c++) {
+		avg_mrr += reciprocal_rank[c];
+	}
+	if (num_baskets > 0) {
+		avg_mrr /= (double)num_baskets;
+	}
+	std::cout << std::endl;
+
+	return avg_mrr;
+}
+
+void NextBasketRecommender::reportIndex(Dataset* dataset) {
+	int num_items = dataset->max_item_id+1;
+	const BasketCaseDB& test_data = dataset->test_data;
+	int num_queries = test_data.size();
+	std::vector<double> scores(num_items);
+	std::vector<WeightedItem> exact_top(N);
+	std::vector<WeightedItem> index_top(N);
+	
+	double exact_time = 0;
+	double index_time = 0;
+	long long num_found = 0;
+	long long num_relevant = 0;
+	for (int c = 0; c < num_queries; c++) {
+		double t = getwalltime();
+		int num_exact = NextBasketRecommender::predictTopItems(test_data.user_id[c], test_data.time_id[c], test_data.basket(c), num_items, &exact_top[0], N, &scores[0]);
+		exact_time += getwalltime() - t;
+		t = getwalltime();
+		int num_index = predictTopItems(test_data.user_id[c], test_data.time_id[c], test_data.basket(c), num_items, &index_top[0], N, &scores[0]);
+		index_time += getwalltime() - t;
+		for (int i = 0; i < num_exact; i++) {
+			for (int j = 0; j < num_index; j++) {
+				if (exact_top[i].item_id == index_top[j].item_id) {
+					num_found++;
+					break;
+				}
+			}
+		}
+		num_relevant += num_exact;
+	}
+	std::cout << "Index: recall@" << N << "=" << (double) num_found / std::max(num_relevant, 1LL)
+		<< " exact queries/s=" << num_queries / exact_time
+		<< " index queries/s=" << num_queries / index_time
+		<< std::endl;
+}
+
+
+void NextBasketRecommender::predictScores(int user_id, int time_id, const BasketRef& basket, double* scores, int num_items) {
 	for (int t = 0; t < num_items; t++) {
-		items[t].weight = predict(user_id, time_id, items[t].item_id, basket);
+		scores[t] = predict(user_id, time_id, t, basket);
 	}
 }
 
 
-SparseTensorDouble NextBasketRecommender::testpredict(SparseTensorBoolean& baskets, int num_items, int max_items_per_basket_out) {
-	WeightedItem* weighted_item = new WeightedItem[num_items];
+int NextBasketRecommender::predictTopItems(int user_id, int time_id, const BasketRef& basket, int num_items, WeightedItem* top, int n, double* scores) {
+	predictScores(user_id, time_id, basket, scores, num_items);
+	return selectTopItems(scores, num_items, top, n);
+}
+
+
+void NextBasketRecommender::predictScoresBatch(const int* user_ids, const BasketRef* baskets, int num_queries, double* scores, int num_items) {
+	for (int q = 0; q < num_queries; q++) {
+		predictScores(user_ids[q], 0, baskets[q], scores + (long long) q * num_items, num_items);
+	}
+}
+
+
+void NextBasketRecommender::predictTopItemsBatch(const int* user_ids, const BasketRef* baskets, int num_queries, int num_items, WeightedItem* top, int n, int* num_top, double* scores) {
+	ThreadPool& pool = threadPool();
+	pool.run([&](int thread_id) {
+		int q_begin = pool.rangeBegin(num_queries, thread_id);
+		int q_end = pool.rangeBegin(num_queries, thread_id+1);
+		if (q_begin == q_end) {
+			return;
+		}
+		predictScoresBatch(user_ids + q_begin, baskets + q_begin, q_end - q_begin, scores + (long long) q_begin * num_items, num_items);
+		for (int q = q_begin; q < q_end; q++) {
+			num_top[q] = selectTopItems(scores + (long long) q * num_items, num_items, top + (long long) q * n, n);
+		}
+	});
+}
+
+
+SparseTensorDouble NextBasketRecommender::testpredict(const BasketCaseDB& cases, int num_items, int max_items_per_basket_out) {
+	std::vector<double> scores(num_items);
+	std::vector<WeightedItem> top(std::max(max_items_per_basket_out, 1));
 	SparseTensorDouble prediction;
 	
-	for (SparseTensorBoolean::const_iterator u = baskets.begin(); u != baskets.end(); ++u) {
-		for (SparseMatrixBoolean::const_iterator t = u->second.begin(); t != u->second.end(); ++t) {
-			int user_id = u->first;
-			int time_id = t->first;
-
-			for (int i = 0; i < num_items; i++) {
-				weighted_item[i].item_id = i;
-				weighted_item[i].weight = 0;
-			}				
-			predictTopItems(user_id, time_id, weighted_item, num_items, &(t->second));
-			std::sort(weighted_item, weighted_item+num_items);
-	
-			for (int i = 0; i < std::min(num_items, max_items_per_basket_out); i++) {
-				prediction[user_id][time_id][weighted_item[num_items-i-1].item_id] = weighted_item[num_items-i-1].weight;
-			}
+	prepareScoring();
+	for (int c = 0; c < cases.size(); c++) {
+		int user_id = cases.user_id[c];
+		int time_id = cases.time_id[c];
+		// one prediction per (user, time): use the last case of each run
+		if ((c+1 < cases.size()) && (cases.user_id[c+1] == user_id) && (cases.time_id[c+1] == time_id)) {
+			continue;
+		}
+
+		int num_top = predictTopItems(user_id, time_id, cases.basket(c), num_items, &top[0], max_items_per_basket_out, &scores[0]);
+		for (int i = 0; i < num_top; i++) {
+			prediction[user_id][time_id][top[i].item_id] = top[i].weight;
 		}
 	}
-	delete[] weighted_item;
 	return prediction;
 }
 
 
-void NextBasketRecommender::savePrediction(SparseTensorBoolean& baskets, const std::string& filename, int num_items, int max_items_per_basket_out) {
-	SparseTensorDouble prediction = testpredict(baskets, num_items, max_items_per_basket_out);		
-	prediction.toFile(filename);	
-}		
+void NextBasketRecommender::savePrediction(const BasketCaseDB& cases, const std::string& filename, int num_items, int max_items_per_basket_out, bool binary) {
+	// one prediction per (user, time): use the last case of each run
+	std::vector<int> rows;
+	for (int c = 0; c < cases.size(); c++) {
+		if ((c+1 < cases.size()) && (cases.user_id[c+1] == cases.user_id[c]) && (cases.time_id[c+1] == cases.time_id[c])) {
+			continue;
+		}
+		rows.push_back(c);
+	}
+	// with raw ids the rows and items follow the raw ids, as in a run without remapping
+	std::vector<int> user_rank, item_rank;
+	if (! user_ids.empty()) {
+		user_rank = user_ids.rankByName();
+		std::stable_sort(rows.begin(), rows.end(), [&](int a, int b) {
+			if (cases.user_id[a] != cases.user_id[b]) { return user_rank[cases.user_id[a]] < user_rank[cases.user_id[b]]; }
+			return cases.time_id[a] < cases.time_id[b];
+		});
+	}
+	if (! item_ids.empty()) {
+		item_rank = item_ids.rankByName();
+	}
+	const int n = std::max(max_items_per_basket_out, 0);
+	const int block_size = 256;
+	long long num_blocks = ((long long) rows.size() + block_size - 1) / block_size;
+
+	prepareScoring();
+	ThreadPool& pool = threadPool();
+	OrderedWriter writer(filename, 4 * pool.num_threads);
+	// block 0 is the header, block b+1 holds the rows [b*block_size, (b+1)*block_size)
+	std::string header_block;
+	if (binary) {
+		TopNFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TOPN_FILE_MAGIC, sizeof(header.magic));
+		header.version = TOPN_FILE_VERSION;
+		header.num_top_max = n;
+		header.num_rows = rows.size();
+		header_block.assign((const char*) &header, sizeof(header));
+	}
+	writer.put(0, header_block);
+
+	auto rawUser = [&](int user_id) { return user_ids.empty() ? user_id : user_ids.numericName(user_id); };
+	auto rawItem = [&](int item_id) { return item_ids.empty() ? item_id : item_ids.numericName(item_id); };
+	auto appendId = [](std::string& out, const IdDictionary& ids, int id) {
+		if (ids.empty()) {
+			appendInt(out, id);
+		} else {
+			out += ids.name(id);
+		}
+	};
+
+	std::atomic<long long> next_block(0);
+	pool.run([&](int thread_id) {
+		std::vector<double> scores(num_items);
+		std::vector<WeightedItem> top(std::max(n, 1));
+		std::string buffer;
+		try {
+			for (long long b = next_block++; b < num_blocks; b = next_block++) {
+				if (! writer.waitForTurn(b+1)) {
+					return;
+				}
+				int r_end = std::min((long long) rows.size(), (b+1) * block_size);
+				for (int r = b * block_size; r < r_end; r++) {
+					int c = rows[r];
+					int num_top = predictTopItems(cases.user_id[c], cases.time_id[c], cases.basket(c), num_items, &top[0], n, &scores[0]);
+					if (binary) {
+						int record[3] = { rawUser(cases.user_id[c]), cases.time_id[c], num_top };
+						buffer.append((const char*) record, sizeof(record));
+						for (int i = 0; i < n; i++) {
+							int item_id = (i < num_top) ? rawItem(top[i].item_id) : -1;
+							float score = (i < num_top) ? (float) top[i].weight : 0.0f;
+							buffer.append((const char*) &item_id, sizeof(item_id));
+							buffer.append((const char*) &score, sizeof(score));
+						}
+					} else {
+						if (item_rank.empty()) {
+							std::sort(top.begin(), top.begin() + num_top, [](const WeightedItem& a, const WeightedItem& b) { return a.item_id < b.item_id; });
+						} else {
+							std::sort(top.begin(), top.begin() + num_top, [&](const WeightedItem& a, const WeightedItem& b) { return item_rank[a.item_id] < item_rank[b.item_id]; });
+						}
+						for (int i = 0; i < num_top; i++) {
+							appendId(buffer, user_ids, cases.user_id[c]);
+							buffer += ' ';
+							appendInt(buffer, cases.time_id[c]);
+							buffer += ' ';
+							appendId(buffer, item_ids, top[i].item_id);
+							buffer += ' ';
+							appendDouble(buffer, top[i].weight);
+							buffer += '\n';
+						}
+					}
+				}
+				writer.put(b+1, buffer);
+			}
+		} catch (...) {
+			writer.fail();
+			throw;
+		}
+	});
+	writer.close();
+}
 		
 
 
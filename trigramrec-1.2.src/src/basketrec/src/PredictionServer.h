@@ -0,0 +1,232 @@
+/*
+	Line protocol prediction server
+
+	Reads one request per line from the input stream:
+		user_id item_1 item_2 ... item_k
+	with the recent items in the order of the data files (item_k is the most
+	recent one) and answers each request with one line, in request order:
+		user_id item:score item:score ...
+	or "ERR <message>" for requests that cannot be scored. For a model with id
+	dictionaries the ids are raw ids in both directions. A reader thread
+	queues the requests; the scoring loop takes everything that has arrived
+	(up to batch_size requests) and scores it as one micro-batch.
+*/
+
+#ifndef PREDICTIONSERVER_H_
+#define PREDICTIONSERVER_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdlib>
+#include "NextBasketRecommender.h"
+
+class PredictionServer {
+	private:
+		struct Request {
+			std::string line;
+			double arrival_time;
+		};
+
+		NextBasketRecommender& rec;
+		std::mutex mutex;
+		std::condition_variable cv_request;
+		std::deque<Request> queue;
+		bool is_input_closed;
+
+		void readRequests(std::istream& in) {
+			std::string line;
+			while (std::getline(in, line)) {
+				if (line.empty()) {
+					continue;
+				}
+				Request request;
+				request.line = line;
+				request.arrival_time = getwalltime();
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					queue.push_back(request);
+				}
+				cv_request.notify_one();
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				is_input_closed = true;
+			}
+			cv_request.notify_one();
+		}
+
+		// the dense id of token: -1 if it is unknown, -2 if it is no integer (without dictionary)
+		static int denseId(const std::string& token, const IdDictionary& ids, int num_ids) {
+			if (! ids.empty()) {
+				int id = ids.find(token);
+				return (id < num_ids) ? id : -1;
+			}
+			char* end;
+			long long id = strtoll(token.c_str(), &end, 10);
+			if ((end == token.c_str()) || (*end != 0)) {
+				return -2;
+			}
+			return ((id >= 0) && (id < num_ids)) ? id : -1;
+		}
+
+		// parses "user_id item_1 ... item_k" into user and history (most recent first)
+		std::string parseRequest(const std::string& line, int& user_id, std::vector<int>& history) {
+			std::istringstream tokens(line);
+			std::string token;
+			if (! (tokens >> token) || ((user_id = denseId(token, rec.user_ids, num_user)) == -2)) {
+				return "cannot parse user id";
+			}
+			if (user_id < 0) {
+				return "unknown user";
+			}
+			history.clear();
+			while (tokens >> token) {
+				int id = denseId(token, rec.item_ids, num_items);
+				if (id == -2) {
+					return "cannot parse item id";
+				} else if (id < 0) {
+					return "unknown item";
+				}
+				history.push_back(id);
+			}
+			if (history.empty()) {
+				return "no recent items";
+			}
+			std::reverse(history.begin(), history.end());
+			return "";
+		}
+
+	public:
+		int num_user;
+		int num_items;
+		int num_out;
+		int batch_size;
+
+		std::vector<double> latency;
+		std::vector<int> batch_length;
+
+		PredictionServer(NextBasketRecommender& p_rec, int p_num_user, int p_num_items) : rec(p_rec) {
+			num_user = p_num_user;
+			num_items = p_num_items;
+			num_out = 10;
+			batch_size = 64;
+			is_input_closed = false;
+		}
+
+		void run(std::istream& in, std::ostream& out);
+		void printStatistics(std::ostream& out);
+};
+
+
+void PredictionServer::run(std::istream& in, std::ostream& out) {
+	rec.prepareScoring();
+	std::thread reader(&PredictionServer::readRequests, this, std::ref(in));
+
+	std::vector<Request> batch;
+	std::vector<int> user_id;
+	std::vector<std::vector<int> > history;
+	std::vector<BasketRef> basket;
+	std::vector<std::string> error;
+	std::vector<int> query_index;
+	std::vector<double> scores;
+	std::vector<WeightedItem> top;
+	std::vector<int> num_top;
+	while (true) {
+		batch.clear();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_request.wait(lock, [&] { return is_input_closed || ! queue.empty(); });
+			if (queue.empty()) {
+				break;
+			}
+			while (! queue.empty() && ((int) batch.size() < batch_size)) {
+				batch.push_back(queue.front());
+				queue.pop_front();
+			}
+		}
+
+		int num_requests = batch.size();
+		user_id.assign(num_requests, 0);
+		history.resize(num_requests);
+		error.assign(num_requests, "");
+		basket.clear();
+		query_index.clear();
+		for (int r = 0; r < num_requests; r++) {
+			error[r] = parseRequest(batch[r].line, user_id[r], history[r]);
+			if (error[r].empty()) {
+				query_index.push_back(r);
+			}
+		}
+		int num_queries = query_index.size();
+		std::vector<int> query_user(num_queries);
+		for (int q = 0; q < num_queries; q++) {
+			query_user[q] = user_id[query_index[q]];
+			basket.push_back(BasketRef(&history[query_index[q]][0], history[query_index[q]].size()));
+		}
+
+		scores.resize((long long) num_queries * num_items);
+		top.resize((long long) num_queries * num_out);
+		num_top.assign(num_queries, 0);
+		if (num_queries > 0) {
+			rec.predictTopItemsBatch(&query_user[0], &basket[0], num_queries, num_items, &top[0], num_out, &num_top[0], &scores[0]);
+		}
+
+		std::ostringstream response;
+		response.precision(6);
+		for (int r = 0, q = 0; r < num_requests; r++) {
+			if (! error[r].empty()) {
+				response << "ERR " << error[r] << "\n";
+				continue;
+			}
+			if (rec.user_ids.empty()) {
+				response << user_id[r];
+			} else {
+				response << rec.user_ids.name(user_id[r]);
+			}
+			for (int i = 0; i < num_top[q]; i++) {
+				const WeightedItem& item = top[(long long) q * num_out + i];
+				response << " ";
+				if (rec.item_ids.empty()) {
+					response << item.item_id;
+				} else {
+					response << rec.item_ids.name(item.item_id);
+				}
+				response << ":" << item.weight;
+			}
+			response << "\n";
+			q++;
+		}
+		out << response.str();
+		out.flush();
+
+		double done_time = getwalltime();
+		for (int r = 0; r < num_requests; r++) {
+			latency.push_back(done_time - batch[r].arrival_time);
+		}
+		batch_length.push_back(num_requests);
+	}
+	reader.join();
+}
+
+void PredictionServer::printStatistics(std::ostream& out) {
+	if (latency.empty()) {
+		out << "served 0 requests" << std::endl;
+		return;
+	}
+	std::vector<double> sorted(latency);
+	std::sort(sorted.begin(), sorted.end());
+	double p50 = sorted[(sorted.size() - 1) / 2];
+	double p99 = sorted[(size_t) ((sorted.size() - 1) * 0.99)];
+	out << "served " << latency.size() << " requests in " << batch_length.size() << " batches"
+		<< " (avg batch " << (double) latency.size() / batch_length.size() << ")"
+		<< " latency p50=" << p50 * 1000.0 << " ms p99=" << p99 * 1000.0 << " ms" << std::endl;
+}
+
+#endif /*PREDICTIONSERVER_H_*/
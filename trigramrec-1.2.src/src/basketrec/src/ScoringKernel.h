@@ -0,0 +1,65 @@
+/*
+	Blocked matrix-vector scoring kernel
+
+	Scores a batch of query vectors against every row of an item matrix:
+	scores[q * score_stride + i] = <query_q, item_i>. Items are processed in
+	blocks that stay in cache while all queries of the batch are scored
+	against them, and four items share each load of the query. Items may be
+	stored as double, float or bfloat16 (I); the query and the sums use the
+	compute type Q of the items.
+*/
+
+#ifndef SCORINGKERNEL_H_
+#define SCORINGKERNEL_H_
+
+#include <algorithm>
+#include "../../util/bfloat16.h"
+
+// number of item rows per cache block (sized for ~64KB of item factors)
+inline int scoringBlockSize(int dim, int value_size = sizeof(double)) {
+	return std::max(4, (int) (65536 / (value_size * std::max(dim, 1))) & ~3);
+}
+
+template <typename Q, typename I> inline void scoreItemRange(const Q* query, const I* items, int item_stride, int item_begin, int item_end, int dim, double* scores) {
+	int i = item_begin;
+	for (; i + 4 <= item_end; i += 4) {
+		const I* x0 = items + (long long) i * item_stride;
+		const I* x1 = x0 + item_stride;
+		const I* x2 = x1 + item_stride;
+		const I* x3 = x2 + item_stride;
+		Q s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		#pragma omp simd reduction(+:s0,s1,s2,s3)
+		for (int d = 0; d < dim; d++) {
+			Q q_d = query[d];
+			s0 += q_d * (Q) x0[d];
+			s1 += q_d * (Q) x1[d];
+			s2 += q_d * (Q) x2[d];
+			s3 += q_d * (Q) x3[d];
+		}
+		scores[i] = s0;
+		scores[i+1] = s1;
+		scores[i+2] = s2;
+		scores[i+3] = s3;
+	}
+	for (; i < item_end; i++) {
+		const I* x = items + (long long) i * item_stride;
+		Q s = 0;
+		#pragma omp simd reduction(+:s)
+		for (int d = 0; d < dim; d++) {
+			s += query[d] * (Q) x[d];
+		}
+		scores[i] = s;
+	}
+}
+
+template <typename Q, typename I> inline void scoreItems(const Q* query, int num_queries, int query_stride, const I* items, int num_items, int item_stride, int dim, double* scores, int score_stride) {
+	int block_size = scoringBlockSize(dim, sizeof(I));
+	for (int block_begin = 0; block_begin < num_items; block_begin += block_size) {
+		int block_end = std::min(block_begin + block_size, num_items);
+		for (int q = 0; q < num_queries; q++) {
+			scoreItemRange(query + (long long) q * query_stride, items, item_stride, block_begin, block_end, dim, scores + (long long) q * score_stride);
+		}
+	}
+}
+
+#endif /*SCORINGKERNEL_H_*/
@@ -14,17 +14,157 @@
 #define BASKET_REC_FPMC_H_
 
 #include "BPRLearner.h"
+#include "ScoringKernel.h"
+#include "MIPSIndex.h"
 #include "../../util/util.h"
+#include "../../util/mapped_file.h"
+#include "../../util/bfloat16.h"
+#include "../../util/aligned_buffer.h"
+#include <cstring>
 using namespace std;
 
+// binary model file: this header, then V_UI, V_LI, V_MI and the item block
+// [V_IU | V_IL | V_IM] (one row of 3*num_feature values per item), each
+// section starting at a multiple of MODEL_FILE_ALIGNMENT; value_size is the
+// storage precision (8: double, 4: float, 2: bfloat16). Since version 2 a model
+// trained on remapped ids ends with the id section: the raw ids of the users,
+// then those of the items, one per line (length_ids = 0: no dictionaries).
+// Version 3 adds mean_transition and history; older files use the last two items
+const char MODEL_FILE_MAGIC[8] = { 'F', 'P', 'M', 'C', 'M', 'O', 'D', 'L' };
+const int MODEL_FILE_VERSION = 3;
+const int MODEL_FILE_ALIGNMENT = 64;
+
+struct FPMCModelHeader {
+	char magic[8];
+	int version;
+	int value_size;
+	int num_user, num_item, num_feature;
+	int loss_function, num_iterations, num_neg_samples;
+	double learn_rate, init_mean, init_stdev;
+	double regular_UI, regular_IU, regular_IL, regular_LI, regular_MI, regular_IM;
+	long long offset_UI, offset_LI, offset_MI, offset_item;
+	long long offset_ids, length_ids;
+	int mean_transition, history;
+};
+
+// hyperparameters, training and the storage independent part of FPMC;
+// the factors live in NextBasketRecommenderFPMCImpl<T>, see create()
 class NextBasketRecommenderFPMC : public NextBasketRecommender {
-	protected:	
-		DMatrixDouble V_UI, V_IU, V_IL, V_LI, V_MI, V_IM;	
+	protected:
+		void writeHeader(FPMCModelHeader& header, int value_size, long long ids_length) {
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+			header.version = MODEL_FILE_VERSION;
+			header.value_size = value_size;
+			header.num_user = num_user;
+			header.num_item = num_item;
+			header.num_feature = num_feature;
+			header.loss_function = loss_function;
+			header.num_iterations = num_iterations;
+			header.num_neg_samples = num_neg_samples;
+			header.learn_rate = learn_rate;
+			header.init_mean = init_mean;
+			header.init_stdev = init_stdev;
+			header.regular_UI = regular_UI;
+			header.regular_IU = regular_IU;
+			header.regular_IL = regular_IL;
+			header.regular_LI = regular_LI;
+			header.regular_MI = regular_MI;
+			header.regular_IM = regular_IM;
+			header.mean_transition = mean_transition;
+			header.history = history;
+			long long user_bytes = (long long) num_user * num_feature * value_size;
+			long long item_bytes = (long long) num_item * num_feature * value_size;
+			header.offset_UI = alignOffset(sizeof(header));
+			header.offset_LI = alignOffset(header.offset_UI + user_bytes);
+			header.offset_MI = alignOffset(header.offset_LI + item_bytes);
+			header.offset_item = alignOffset(header.offset_MI + item_bytes);
+			header.offset_ids = (ids_length > 0) ? alignOffset(header.offset_item + 3 * item_bytes) : 0;
+			header.length_ids = ids_length;
+		}
+
+		// the id section of the model file; empty if the ids are not remapped
+		std::string idSection() {
+			std::string section;
+			if (user_ids.empty() && item_ids.empty()) {
+				return section;
+			}
+			if ((user_ids.size() != num_user) || (item_ids.size() != num_item)) {
+				throw std::string("the id dictionaries do not match the users and items of the model");
+			}
+			user_ids.write(section);
+			item_ids.write(section);
+			return section;
+		}
+
+		// checks magic and version; version 1 files have no id section
+		static void checkHeader(FPMCModelHeader& header, const std::string& filename) {
+			if (memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0) {
+				throw "Not a model file: " + filename;
+			}
+			if ((header.version < 1) || (header.version > MODEL_FILE_VERSION)) {
+				throw "Unsupported model file version: " + filename;
+			}
+			if (header.version == 1) {
+				header.offset_ids = 0;
+				header.length_ids = 0;
+			}
+			if (header.version <= 2) {
+				header.mean_transition = 0;
+				header.history = 2;
+			}
+		}
+
+		static void readIdSection(const FPMCModelHeader& header, const char* section, IdDictionary& users, IdDictionary& items, const std::string& filename) {
+			const char* p = section;
+			const char* end = section + header.length_ids;
+			if (! users.read(p, end, header.num_user) || ! items.read(p, end, header.num_item)) {
+				throw "Truncated model file: " + filename;
+			}
+		}
+
+		void readHeader(const FPMCModelHeader& header) {
+			num_user = header.num_user;
+			num_item = header.num_item;
+			num_feature = header.num_feature;
+			loss_function = header.loss_function;
+			num_iterations = header.num_iterations;
+			num_neg_samples = header.num_neg_samples;
+			learn_rate = header.learn_rate;
+			init_mean = header.init_mean;
+			init_stdev = header.init_stdev;
+			regular_UI = header.regular_UI;
+			regular_IU = header.regular_IU;
+			regular_IL = header.regular_IL;
+			regular_LI = header.regular_LI;
+			regular_MI = header.regular_MI;
+			regular_IM = header.regular_IM;
+			mean_transition = header.mean_transition;
+			history = header.history;
+		}
+
+		static long long alignOffset(long long pos) {
+			return (pos + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+		}
+
+		// true while all factors are in the shared memory of init() (see num_processes)
+		bool shared_factors;
+
 	public:	
 		int loss_function;
 		int num_neg_samples;
 		int num_iterations;
 		double learn_rate;
+		std::string sampler;
+		double sampler_lambda;
+		double target_mrr;
+		int eval_every, eval_sample, patience;
+		bool keep_best;
+		// "uniform" or "blocked", see BasketLearnerBPR::schedule
+		std::string schedule;
+		int schedule_block, schedule_negatives;
+		// training telemetry, see BasketLearnerBPR::log
+		RLog* log;
 
 		int num_feature;
 		double regular_UI, regular_IU, regular_IL, regular_LI, regular_MI, regular_IM;
@@ -33,52 +173,488 @@ class NextBasketRecommenderFPMC : public NextBasketRecommender {
 	
 		double init_stdev;
 		double init_mean;
+
+		// the transition part of the score uses the history items n-1 .. n-history (0: all of
+		// them); false: item n-1 through V_LI/V_IL and the mean of the older ones through
+		// V_MI/V_IM (with history 2 the FPMC of the last two items), true: the mean of all of
+		// them through V_LI/V_IL as in Rendle et al. (2010)
+		bool mean_transition;
+		int history;
+
+		// init() stores each item's [IU | IL | IM] in one row and pads all rows to cache lines;
+		// false: one separate matrix per factor
+		bool interleaved_layout;
+		// back the factors of init() by transparent huge pages
+		bool huge_pages;
+		// > 1: init() puts the factors in shared memory and train() forks num_processes-1 worker
+		// processes that train on disjoint shards of the cases (see BasketLearnerBPR::processes)
+		int num_processes;
+
+		NextBasketRecommenderFPMC() {
+			interleaved_layout = true;
+			huge_pages = false;
+			num_processes = 1;
+			mean_transition = false;
+			history = 2;
+			shared_factors = false;
+			// the training options default to the learner's defaults
+			BasketLearnerBPR defaults;
+			eval_every = defaults.eval_every;
+			eval_sample = defaults.eval_sample;
+			patience = defaults.patience;
+			keep_best = defaults.keep_best;
+			schedule = defaults.schedule;
+			schedule_block = defaults.schedule_block;
+			schedule_negatives = defaults.schedule_negatives;
+			log = NULL;
+		}
+
+		// "double", "float" or "bf16" (bfloat16 storage, float arithmetic)
+		static NextBasketRecommenderFPMC* create(const std::string& precision);
+		// precision of the values in a model file written by saveModel
+		static std::string modelPrecision(const std::string& filename);
+		// reads the id dictionaries of a model file; false if its ids are not remapped
+		static bool modelIds(const std::string& filename, IdDictionary& users, IdDictionary& items);
+
+		virtual std::string precision() = 0;
 				
 		virtual double train(Dataset& dataset) {
 			BasketLearnerBPR learner;
 			learner.num_iterations = this->num_iterations;
 			learner.num_neg_samples = this->num_neg_samples;
+			learner.sampler = this->sampler;
+			learner.sampler_lambda = this->sampler_lambda;
+			learner.target_mrr = this->target_mrr;
+			learner.eval_every = this->eval_every;
+			learner.eval_sample = this->eval_sample;
+			learner.patience = this->patience;
+			learner.keep_best = this->keep_best;
+			learner.schedule = this->schedule;
+			learner.schedule_block = this->schedule_block;
+			learner.schedule_negatives = this->schedule_negatives;
+			learner.log = this->log;
+			if (num_processes <= 1) {
+				return learner.train(dataset, *this);
+			}
+			if (! shared_factors) {
+				throw std::string("training with several processes needs factors in shared memory from init() with num_processes > 1");
+			}
+			ProcessGroup processes;
+			std::cout.flush();
+			if (processes.start(num_processes) > 0) {
+				// the threads of the pool were not forked; the worker reports nothing and
+				// ends without running the destructors of the coordinator's objects
+				detachThreadPool();
+				std::cout.setstate(std::ios::badbit);
+				learner.log = NULL;
+				learner.processes = &processes;
+				int status = 0;
+				try {
+					learner.train(dataset, *this);
+				} catch (std::string &e) {
+					std::cerr << "worker process " << processes.rank << ": " << e << std::endl;
+					status = 1;
+				}
+				_exit(status);
+			}
+			learner.processes = &processes;
 			double best_mrr = learner.train(dataset, *this);
+			processes.finish();
 			return best_mrr;
 		}
+
+		virtual void init() = 0;
+		// adds factors for unseen users and items; the existing rows (possibly mapped) stay in place
+		virtual void grow(int new_num_user, int new_num_item) = 0;
+};
+
+template <typename T> class NextBasketRecommenderFPMCImpl : public NextBasketRecommenderFPMC {
+	protected:	
+		// arithmetic type for values stored as T
+		typedef typename ComputeType<T>::type C;
+
+		DMatrixReal<T> V_UI, V_IU, V_IL, V_LI, V_MI, V_IM;	
+		// item side of the scoring engine: row i = [V_IU(i) | V_IL(i) | V_IM(i)]
+		DMatrixReal<T> V_item;
+		MIPSIndexIVF index;
+		// backing memory of a model opened with loadModel
+		MappedFile model_file;
+		// V_item converted to double for the index and the adaptive sampler (unused if T is double)
+		std::vector<double> item_snapshot;
+		// copy of V_UI, V_IU, V_IL, V_LI, V_MI, V_IM (in this order) taken by saveSnapshot
+		std::vector<T> snapshot;
+		// memory of the interleaved layout
+		AlignedBuffer user_memory, item_memory, last_item_memory, prev_item_memory;
+
+		// direct row addressing base + x * stride, used instead of the row tables while every matrix is strided
+		struct StridedRows {
+			T* base;
+			size_t stride;
+		};
+		StridedRows rows_UI, rows_IU, rows_IL, rows_LI, rows_MI, rows_IM;
+		bool is_strided;
+
+		// to be called whenever the factor matrices have been (re)allocated
+		void updateLayout() {
+			DMatrixReal<T>* factors[] = { &V_UI, &V_IU, &V_IL, &V_LI, &V_MI, &V_IM };
+			StridedRows* rows[] = { &rows_UI, &rows_IU, &rows_IL, &rows_LI, &rows_MI, &rows_IM };
+			is_strided = true;
+			for (int m = 0; m < 6; m++) {
+				is_strided = is_strided && factors[m]->isStrided();
+				rows[m]->base = factors[m]->value[0];
+				rows[m]->stride = factors[m]->rowStride();
+			}
+		}
+
+		inline T* rowOf(const DMatrixReal<T>& m, const StridedRows& rows, int x) const {
+			return is_strided ? rows.base + (size_t) x * rows.stride : m.value[x];
+		}
+
+		static void writeAligned(std::ofstream& out, long long& pos, long long offset, const T* data, long long length) {
+			for (; pos < offset; pos++) {
+				out.put(0);
+			}
+			out.write((const char*) data, length * sizeof(T));
+			pos += length * sizeof(T);
+		}
+
+		// num_rows rows of dim values (row x at values + x * stride) as packed doubles
+		template <typename V> static const double* asDouble(const V* values, long long num_rows, int dim, size_t stride, std::vector<double>& buffer) {
+			buffer.resize(num_rows * dim);
+			for (long long x = 0; x < num_rows; x++) {
+				std::copy(values + x * stride, values + x * stride + dim, &buffer[x * dim]);
+			}
+			return &buffer[0];
+		}
+		static const double* asDouble(const double* values, long long num_rows, int dim, size_t stride, std::vector<double>& buffer) {
+			if (stride == (size_t) dim) {
+				return values;
+			}
+			return asDouble<double>(values, num_rows, dim, stride, buffer);
+		}
+
+		// number of history items the transition part uses
+		inline int historyLength(const BasketRef& basket) const {
+			return ((history > 0) && (history < basket.size())) ? history : basket.size();
+		}
+
+		// basket side of the score: L (against V_IL) and M (against V_IM), see mean_transition;
+		// K = number of history items fixed at compile time (0: len at runtime)
+		template <int K, typename Q> inline void embedBasketK(const BasketRef& basket, int len, Q* __restrict__ L, Q* __restrict__ M) {
+			if (K > 0) {
+				len = K;
+			}
+			const int dim = num_feature;
+			if (mean_transition) {
+				for (int f = 0; f < dim; f++) {
+					L[f] = 0;
+					M[f] = 0;
+				}
+				for (int p = 0; p < len; p++) {
+					const T* LI_r = rowOf(V_LI, rows_LI, basket[p]);
+					for (int f = 0; f < dim; f++) {
+						L[f] += (Q) LI_r[f];
+					}
+				}
+				if (len > 1) {
+					const Q w = (Q) 1 / len;
+					for (int f = 0; f < dim; f++) {
+						L[f] *= w;
+					}
+				}
+				return;
+			}
+			const T* LI_l = rowOf(V_LI, rows_LI, basket[0]);
+			for (int f = 0; f < dim; f++) {
+				L[f] = (Q) LI_l[f];
+				M[f] = 0;
+			}
+			for (int p = 1; p < len; p++) {
+				const T* MI_r = rowOf(V_MI, rows_MI, basket[p]);
+				for (int f = 0; f < dim; f++) {
+					M[f] += (Q) MI_r[f];
+				}
+			}
+			if (len > 2) {
+				const Q w = (Q) 1 / (len-1);
+				for (int f = 0; f < dim; f++) {
+					M[f] *= w;
+				}
+			}
+		}
+
+		template <typename Q> void embedBasket(const BasketRef& basket, Q* L, Q* M) {
+			int len = historyLength(basket);
+			switch (len) {
+				case 1: embedBasketK<1>(basket, len, L, M); break;
+				case 2: embedBasketK<2>(basket, len, L, M); break;
+				case 3: embedBasketK<3>(basket, len, L, M); break;
+				case 4: embedBasketK<4>(basket, len, L, M); break;
+				default: embedBasketK<0>(basket, len, L, M); break;
+			}
+		}
+
+		// query side matching V_item: [V_UI(u) | L | M]; with the defaults [V_UI(u) | V_LI(item_n-1) | V_MI(item_n-2) or 0]
+		template <typename Q> void fillQuery(int user_id, const BasketRef& basket, Q* query) {
+			for (int f = 0; f < num_feature; f++) {
+				query[f] = this->V_UI(user_id,f);
+			}
+			embedBasket(basket, query + num_feature, query + 2*num_feature);
+		}
+
+	public:
+		NextBasketRecommenderFPMCImpl() { is_strided = false; }
+
+		virtual std::string precision() { return precisionName<T>(); }
 				
 		virtual void init() {
-			this->V_UI.setSize(num_user, num_feature);
-			this->V_IU.setSize(num_item, num_feature);			
-			this->V_IL.setSize(num_item,  num_feature);
-			this->V_LI.setSize(num_item,  num_feature);
-			this->V_MI.setSize(num_item,  num_feature);
-			this->V_IM.setSize(num_item,  num_feature);
-
-			this->V_UI.init(init_mean, init_stdev);
-			this->V_IU.init(init_mean, init_stdev);			
-			this->V_IL.init(init_mean, init_stdev);
-			this->V_LI.init(init_mean, init_stdev);			
-			this->V_MI.init(init_mean, init_stdev);
-			this->V_IM.init(init_mean, init_stdev);
+			shared_factors = (num_processes > 1);
+			if (shared_factors && ! interleaved_layout) {
+				throw std::string("training with several processes needs the interleaved layout");
+			}
+			if (interleaved_layout) {
+				unsigned row_length = paddedRowLength<T>(num_feature);
+				unsigned item_row_length = paddedRowLength<T>(3*num_feature);
+				user_memory.allocate((size_t) num_user * row_length * sizeof(T), huge_pages, shared_factors);
+				item_memory.allocate((size_t) num_item * item_row_length * sizeof(T), huge_pages, shared_factors);
+				last_item_memory.allocate((size_t) num_item * row_length * sizeof(T), huge_pages, shared_factors);
+				prev_item_memory.allocate((size_t) num_item * row_length * sizeof(T), huge_pages, shared_factors);
+				T* item_block = (T*) item_memory.begin();
+				this->V_UI.setExternal(num_user, num_feature, (T*) user_memory.begin(), row_length);
+				this->V_IU.setExternal(num_item, num_feature, item_block, item_row_length);
+				this->V_IL.setExternal(num_item, num_feature, item_block + num_feature, item_row_length);
+				this->V_IM.setExternal(num_item, num_feature, item_block + 2*num_feature, item_row_length);
+				this->V_LI.setExternal(num_item, num_feature, (T*) last_item_memory.begin(), row_length);
+				this->V_MI.setExternal(num_item, num_feature, (T*) prev_item_memory.begin(), row_length);
+				// the scoring engine works on the item rows in place
+				this->V_item.setExternal(num_item, 3*num_feature, item_block, item_row_length);
+			} else {
+				this->V_UI.setSize(num_user, num_feature);
+				this->V_IU.setSize(num_item, num_feature);			
+				this->V_IL.setSize(num_item,  num_feature);
+				this->V_LI.setSize(num_item,  num_feature);
+				this->V_MI.setSize(num_item,  num_feature);
+				this->V_IM.setSize(num_item,  num_feature);
+			}
+
+			this->V_UI.init(init_mean, init_stdev, &threadPool());
+			this->V_IU.init(init_mean, init_stdev, &threadPool());			
+			this->V_IL.init(init_mean, init_stdev, &threadPool());
+			this->V_LI.init(init_mean, init_stdev, &threadPool());			
+			this->V_MI.init(init_mean, init_stdev, &threadPool());
+			this->V_IM.init(init_mean, init_stdev, &threadPool());
+			updateLayout();
 		}
 		
-		//TODO
-		virtual void predictTopItems(int user_id, int time_id, WeightedItem* items, int num_items, const SparseVectorBoolean* basket) {
-			for (int t_x = 0; t_x < num_items; t_x++) {
-      				items[t_x].weight = predict(user_id, time_id, items[t_x].item_id, basket);
+		virtual void prepareScoring() {
+			// a mapped model file already stores the item side in scoring layout
+			if (V_item.isExternal() && (V_item.value[0] == V_IU.value[0]) && (V_item.dim1 == V_IU.dim1)) {
+				return;
+			}
+			this->V_item.setSize(num_item, 3*num_feature);
+			for (int i = 0; i < num_item; i++) {
+				for (int f = 0; f < num_feature; f++) {
+					this->V_item(i,f) = this->V_IU(i,f);
+					this->V_item(i,num_feature+f) = this->V_IL(i,f);
+					this->V_item(i,2*num_feature+f) = this->V_IM(i,f);
+				}
 			}
 		}
 
-		virtual double predict(int user_id, int time_id, int nextitem_id, const SparseVectorBoolean* basket) {
-			double result = 0;
-			double mf_dot = 0;
-			double fmc_dot = 0;
+		virtual void buildQuery(int user_id, const BasketRef& basket, double* query) {
+			fillQuery(user_id, basket, query);
+		}
+
+		virtual int factorDim() { return 3*num_feature; }
+		virtual const double* itemFactors() { return asDouble(V_item.value[0], num_item, 3*num_feature, V_item.rowStride(), item_snapshot); }
+
+		virtual void predictScores(int user_id, int time_id, const BasketRef& basket, double* scores, int num_items) {
+			assert(V_item.dim1 >= (uint) num_items);
+			std::vector<C> query(3*num_feature);
+			fillQuery(user_id, basket, &query[0]);
+			scoreItems(&query[0], 1, 3*num_feature, V_item.value[0], num_items, V_item.rowStride(), 3*num_feature, scores, num_items);
+		}
+
+		virtual void saveSnapshot() {
+			DMatrixReal<T>* factors[] = { &V_UI, &V_IU, &V_IL, &V_LI, &V_MI, &V_IM };
+			snapshot.resize((size_t) (num_user + 5 * num_item) * num_feature);
+			T* pos = &snapshot[0];
+			for (int m = 0; m < 6; m++) {
+				for (uint x = 0; x < factors[m]->dim1; x++, pos += num_feature) {
+					std::copy(factors[m]->value[x], factors[m]->value[x] + num_feature, pos);
+				}
+			}
+		}
+
+		virtual void restoreSnapshot() {
+			DMatrixReal<T>* factors[] = { &V_UI, &V_IU, &V_IL, &V_LI, &V_MI, &V_IM };
+			assert(snapshot.size() == (size_t) (num_user + 5 * num_item) * num_feature);
+			const T* pos = &snapshot[0];
+			for (int m = 0; m < 6; m++) {
+				for (uint x = 0; x < factors[m]->dim1; x++, pos += num_feature) {
+					std::copy(pos, pos + num_feature, factors[m]->value[x]);
+				}
+			}
+		}
+
+		virtual void saveModel(std::string filename) {
+			FPMCModelHeader header;
+			std::string ids = idSection();
+			writeHeader(header, sizeof(T), ids.size());
+
+			// written under a temporary name and renamed, so a mapped model can be replaced in place
+			std::string tmp_filename = filename + ".tmp";
+			std::ofstream out_file (tmp_filename.c_str(), std::ios::out | std::ios::binary);
+			if (! out_file.is_open()) {
+				throw "Unable to open file " + tmp_filename;
+			}
+			out_file.write((const char*) &header, sizeof(header));
+			long long pos = sizeof(header);
+			for (int u = 0; u < num_user; u++) {
+				writeAligned(out_file, pos, header.offset_UI, V_UI(u), num_feature);
+			}
+			for (int i = 0; i < num_item; i++) {
+				writeAligned(out_file, pos, header.offset_LI, V_LI(i), num_feature);
+			}
+			for (int i = 0; i < num_item; i++) {
+				writeAligned(out_file, pos, header.offset_MI, V_MI(i), num_feature);
+			}
+			for (int i = 0; i < num_item; i++) {
+				writeAligned(out_file, pos, header.offset_item, V_IU(i), num_feature);
+				writeAligned(out_file, pos, pos, V_IL(i), num_feature);
+				writeAligned(out_file, pos, pos, V_IM(i), num_feature);
+			}
+			if (! ids.empty()) {
+				for (; pos < header.offset_ids; pos++) {
+					out_file.put(0);
+				}
+				out_file.write(ids.data(), ids.size());
+			}
+			out_file.close();
+			if (out_file.fail() || (rename(tmp_filename.c_str(), filename.c_str()) != 0)) {
+				throw "Unable to write file " + filename;
+			}
+		}
+
+		virtual void grow(int new_num_user, int new_num_item) {
+			// grown rows are private to the process
+			shared_factors = false;
+			if (new_num_user > num_user) {
+				this->V_UI.grow(new_num_user);
+				this->V_UI.init_rows(init_mean, init_stdev, num_user, &threadPool());
+				num_user = new_num_user;
+			}
+			if (new_num_item > num_item) {
+				DMatrixReal<T>* item_factors[] = { &V_IU, &V_IL, &V_LI, &V_MI, &V_IM };
+				for (int m = 0; m < 5; m++) {
+					item_factors[m]->grow(new_num_item);
+					item_factors[m]->init_rows(init_mean, init_stdev, num_item, &threadPool());
+				}
+				num_item = new_num_item;
+			}
+			updateLayout();
+		}
+
+		// maps the model file; the factors are used in place without parsing or copying
+		virtual void loadModel(std::string filename) {
+			model_file.open(filename);
+			if (model_file.size() < sizeof(FPMCModelHeader)) {
+				throw "Not a model file: " + filename;
+			}
+			FPMCModelHeader header;
+			memcpy(&header, model_file.begin(), sizeof(header));
+			checkHeader(header, filename);
+			if (header.value_size != sizeof(T)) {
+				throw "The model file " + filename + " does not store " + precision() + " values";
+			}
+			long long user_bytes = (long long) header.num_user * header.num_feature * sizeof(T);
+			long long item_bytes = (long long) header.num_item * header.num_feature * sizeof(T);
+			if ((header.offset_UI + user_bytes > (long long) model_file.size()) || (header.offset_LI + item_bytes > (long long) model_file.size())
+				|| (header.offset_MI + item_bytes > (long long) model_file.size()) || (header.offset_item + 3 * item_bytes > (long long) model_file.size())
+				|| (header.offset_ids + header.length_ids > (long long) model_file.size())) {
+				throw "Truncated model file: " + filename;
+			}
+			readHeader(header);
+			shared_factors = false;
+			user_ids.clear();
+			item_ids.clear();
+			if (header.length_ids > 0) {
+				readIdSection(header, model_file.begin() + header.offset_ids, user_ids, item_ids, filename);
+			}
+
+			T* item_block = (T*) (model_file.begin() + header.offset_item);
+			this->V_UI.setExternal(num_user, num_feature, (T*) (model_file.begin() + header.offset_UI), num_feature);
+			this->V_LI.setExternal(num_item, num_feature, (T*) (model_file.begin() + header.offset_LI), num_feature);
+			this->V_MI.setExternal(num_item, num_feature, (T*) (model_file.begin() + header.offset_MI), num_feature);
+			this->V_IU.setExternal(num_item, num_feature, item_block, 3*num_feature);
+			this->V_IL.setExternal(num_item, num_feature, item_block + num_feature, 3*num_feature);
+			this->V_IM.setExternal(num_item, num_feature, item_block + 2*num_feature, 3*num_feature);
+			this->V_item.setExternal(num_item, 3*num_feature, item_block, 3*num_feature);
+			updateLayout();
+		}
+
+		virtual int predictTopItems(int user_id, int time_id, const BasketRef& basket, int num_items, WeightedItem* top, int n, double* scores) {
+			if (! index.isBuilt()) {
+				return NextBasketRecommender::predictTopItems(user_id, time_id, basket, num_items, top, n, scores);
+			}
+			std::vector<double> query(3*num_feature);
+			fillQuery(user_id, basket, &query[0]);
+			return index.query(&query[0], top, n, scores);
+		}
+
+		virtual void predictScoresBatch(const int* user_ids, const BasketRef* baskets, int num_queries, double* scores, int num_items) {
+			assert(V_item.dim1 >= (uint) num_items);
+			std::vector<C> query((long long) num_queries * 3*num_feature);
+			for (int q = 0; q < num_queries; q++) {
+				fillQuery(user_ids[q], baskets[q], &query[(long long) q * 3*num_feature]);
+			}
+			scoreItems(&query[0], num_queries, 3*num_feature, V_item.value[0], num_items, V_item.rowStride(), 3*num_feature, scores, num_items);
+		}
+
+		virtual void predictTopItemsBatch(const int* user_ids, const BasketRef* baskets, int num_queries, int num_items, WeightedItem* top, int n, int* num_top, double* scores) {
+			if (! index.isBuilt()) {
+				NextBasketRecommender::predictTopItemsBatch(user_ids, baskets, num_queries, num_items, top, n, num_top, scores);
+				return;
+			}
+			for (int q = 0; q < num_queries; q++) {
+				num_top[q] = predictTopItems(user_ids[q], 0, baskets[q], num_items, top + (long long) q * n, n, scores);
+			}
+		}
+
+		virtual void buildIndex(int num_clusters, int num_probe) {
+			double build_time = getwalltime();
+			prepareScoring();
+			index.num_probe = num_probe;
+			index.build(itemFactors(), num_item, 3*num_feature, 3*num_feature, num_clusters, 10, threadPool());
+			item_snapshot.clear();
+			std::cout << "Index: " << num_clusters << " clusters, probe " << num_probe << ", built in " << (getwalltime() - build_time) << " s" << std::endl;
+		}
+
+		virtual void reportIndex(Dataset* dataset) {
+			NextBasketRecommender::reportIndex(dataset);
+			if (index.isBuilt() && (index.num_queries > 0)) {
+				std::cout << "Index: scanned " << (double) index.num_scanned / index.num_queries / num_item << " of the items per query" << std::endl;
+			}
+		}
+
+		virtual double predict(int user_id, int time_id, int nextitem_id, const BasketRef& basket) {
+			C result = 0;
+			C mf_dot = 0;
+			C fmc_dot = 0;
 			for (int f = 0; f < num_feature; f++) {
-				mf_dot += this->V_UI(user_id,f) * this->V_IU(nextitem_id,f);
+				mf_dot += (C) this->V_UI(user_id,f) * (C) this->V_IU(nextitem_id,f);
 			}
-			//item_n-1
-			SparseVectorBoolean::const_iterator iter = basket->begin();
+			static thread_local std::vector<C> embedding;
+			embedding.resize(2*num_feature);
+			C* L = &embedding[0];
+			C* M = &embedding[num_feature];
+			embedBasket(basket, L, M);
+			bool has_M = ! mean_transition && (historyLength(basket) > 1);
 			
 			for (int f = 0; f < num_feature; f++) {
-				fmc_dot += this->V_IL(nextitem_id,f) * this->V_LI((*iter),f);
-				if(basket->size() > 1) {
-					fmc_dot += this->V_IM(nextitem_id,f) * this->V_MI(*(iter+1),f);
+				fmc_dot += (C) this->V_IL(nextitem_id,f) * L[f];
+				if (has_M) {
+					fmc_dot += (C) this->V_IM(nextitem_id,f) * M[f];
 				}
 			}
 
@@ -89,53 +665,245 @@ class NextBasketRecommenderFPMC : public NextBasketRecommender {
 			}
 			return result;
 		}
-		
-		inline virtual void learn(int user_id, int time_id, int nextitem_p, int nextitem_n, const SparseVectorBoolean* basket) {
-			
-			double x_utnip = predict(user_id, time_id, nextitem_p, basket);
-     		double x_utnin = predict(user_id, time_id, nextitem_n, basket);
-     		double normalizer = BasketLearner::partial_loss(loss_function, x_utnip - x_utnin);
-     		// update the features
-     		for (int f = 0; f < num_feature; f++) {
-     			double UI_u_f = this->V_UI(user_id,f);
-     			double IU_p_f = this->V_IU(nextitem_p,f);
-     			double IU_n_f = this->V_IU(nextitem_n,f);
-				
-     			this->V_UI(user_id, f) += learn_rate * (normalizer * (IU_p_f - IU_n_f) - regular_UI * V_UI(user_id, f));
-     			this->V_IU(nextitem_p, f) += learn_rate * (normalizer * UI_u_f - regular_IU * V_IU(nextitem_p, f));
-     			this->V_IU(nextitem_n, f) += learn_rate * (normalizer * (-UI_u_f) - regular_IU * V_IU(nextitem_n, f));
-     		}
-     		
-
-     		for (int f = 0; f < num_feature; f++) {
-	     		double eta = 0.0;
-	     		SparseVectorBoolean::const_iterator iter = basket->begin();
-
-				eta = this->V_LI((*iter), f);
-				double IL_p_f = this->V_IL(nextitem_p,f);
-     			double IL_n_f = this->V_IL(nextitem_n,f);
-     			double tmp = (this->V_IL(nextitem_p,f) - this->V_IL(nextitem_n,f)) / 1.0;
-     			
-				double LI_item_f = this->V_LI((*iter),f);
-
-				this->V_IL(nextitem_p,f) += learn_rate * (normalizer * eta - regular_IL * IL_p_f);
-     			this->V_IL(nextitem_n,f) += learn_rate * (normalizer * (-eta) - regular_IL * IL_n_f);
-     			
-				this->V_LI((*iter), f) += learn_rate * (normalizer * tmp - regular_LI * LI_item_f);
-     			
-				if(basket->size() > 1) {
-					double tmp_im = (this->V_IM(nextitem_p,f) - this->V_IM(nextitem_n,f)) / 1.0;
-					double MI_item_f = this->V_MI(*(iter + 1),f);
-					double IM_p_f = this->V_IM(nextitem_p,f);
-					double IM_n_f = this->V_IM(nextitem_n,f);
-					this->V_MI(*(iter + 1), f) += learn_rate * (normalizer * tmp_im - regular_MI * MI_item_f);
-					this->V_IM(nextitem_p,f) += learn_rate * (normalizer * MI_item_f - regular_IM * IM_p_f);
-					this->V_IM(nextitem_n,f) += learn_rate * (normalizer * (-MI_item_f) - regular_IM * IM_n_f);
-				}
-     		}
-     		
-     	}
+
+		// one SGD step for (u, last items, p, n): x_p - x_n in one pass, then all factor updates in one sweep.
+		// F = num_feature fixed at compile time (0: runtime); HAS_PREV2: the basket has a second last item
+		template <int F, bool HAS_PREV2> inline void learnFused(int user_id, int nextitem_p, int nextitem_n, const BasketRef& basket) {
+			const int dim = (F > 0) ? F : num_feature;
+			T* __restrict__ UI_u = rowOf(V_UI, rows_UI, user_id);
+			T* __restrict__ IU_p = rowOf(V_IU, rows_IU, nextitem_p);
+			T* __restrict__ IU_n = rowOf(V_IU, rows_IU, nextitem_n);
+			T* __restrict__ LI_l = rowOf(V_LI, rows_LI, basket[0]);
+			T* __restrict__ IL_p = rowOf(V_IL, rows_IL, nextitem_p);
+			T* __restrict__ IL_n = rowOf(V_IL, rows_IL, nextitem_n);
+			T* __restrict__ MI_m = HAS_PREV2 ? rowOf(V_MI, rows_MI, basket[1]) : NULL;
+			T* __restrict__ IM_p = HAS_PREV2 ? rowOf(V_IM, rows_IM, nextitem_p) : NULL;
+			T* __restrict__ IM_n = HAS_PREV2 ? rowOf(V_IM, rows_IM, nextitem_n) : NULL;
+
+			C x_pn = 0;
+			#pragma omp simd reduction(+:x_pn)
+			for (int f = 0; f < dim; f++) {
+				C d = (C) UI_u[f] * ((C) IU_p[f] - (C) IU_n[f]) + (C) LI_l[f] * ((C) IL_p[f] - (C) IL_n[f]);
+				if (HAS_PREV2) {
+					d += (C) MI_m[f] * ((C) IM_p[f] - (C) IM_n[f]);
+				}
+				x_pn += d;
+			}
+			if (isnan(x_pn)) {
+				throw "Prediction is NAN";
+			}
+			const C normalizer = BasketLearner::partial_loss(loss_function, x_pn);
+			const C lr = learn_rate;
+			const C reg_UI = regular_UI, reg_IU = regular_IU, reg_IL = regular_IL, reg_LI = regular_LI, reg_MI = regular_MI, reg_IM = regular_IM;
+
+			const uint32_t seed = roundingSeed();
+
+			// every update reads the values from before this step, as in predict/learn
+			#pragma omp simd
+			for (int f = 0; f < dim; f++) {
+				C UI_u_f = UI_u[f], IU_p_f = IU_p[f], IU_n_f = IU_n[f];
+				C LI_l_f = LI_l[f], IL_p_f = IL_p[f], IL_n_f = IL_n[f];
+				storeUpdate(UI_u[f], UI_u_f + lr * (normalizer * (IU_p_f - IU_n_f) - reg_UI * UI_u_f), roundingNoise(seed, 9*f + 0));
+				storeUpdate(IU_p[f], IU_p_f + lr * (normalizer * UI_u_f - reg_IU * IU_p_f), roundingNoise(seed, 9*f + 1));
+				storeUpdate(IU_n[f], IU_n_f + lr * (normalizer * (-UI_u_f) - reg_IU * IU_n_f), roundingNoise(seed, 9*f + 2));
+				storeUpdate(IL_p[f], IL_p_f + lr * (normalizer * LI_l_f - reg_IL * IL_p_f), roundingNoise(seed, 9*f + 3));
+				storeUpdate(IL_n[f], IL_n_f + lr * (normalizer * (-LI_l_f) - reg_IL * IL_n_f), roundingNoise(seed, 9*f + 4));
+				storeUpdate(LI_l[f], LI_l_f + lr * (normalizer * (IL_p_f - IL_n_f) - reg_LI * LI_l_f), roundingNoise(seed, 9*f + 5));
+				if (HAS_PREV2) {
+					C MI_m_f = MI_m[f], IM_p_f = IM_p[f], IM_n_f = IM_n[f];
+					storeUpdate(MI_m[f], MI_m_f + lr * (normalizer * (IM_p_f - IM_n_f) - reg_MI * MI_m_f), roundingNoise(seed, 9*f + 6));
+					storeUpdate(IM_p[f], IM_p_f + lr * (normalizer * MI_m_f - reg_IM * IM_p_f), roundingNoise(seed, 9*f + 7));
+					storeUpdate(IM_n[f], IM_n_f + lr * (normalizer * (-MI_m_f) - reg_IM * IM_n_f), roundingNoise(seed, 9*f + 8));
+				}
+			}
+		}
+
+		template <bool HAS_PREV2> inline void learnDispatch(int user_id, int nextitem_p, int nextitem_n, const BasketRef& basket) {
+			switch (num_feature) {
+				case 16: learnFused<16, HAS_PREV2>(user_id, nextitem_p, nextitem_n, basket); break;
+				case 32: learnFused<32, HAS_PREV2>(user_id, nextitem_p, nextitem_n, basket); break;
+				case 64: learnFused<64, HAS_PREV2>(user_id, nextitem_p, nextitem_n, basket); break;
+				case 128: learnFused<128, HAS_PREV2>(user_id, nextitem_p, nextitem_n, basket); break;
+				default: learnFused<0, HAS_PREV2>(user_id, nextitem_p, nextitem_n, basket); break;
+			}
+		}
+
+		// SGD steps for (u, history, p) and each negative. L and M are computed once and then
+		// updated with the history rows, so a step costs O(F) for the scores plus the row updates;
+		// the cached values are exact up to rounding unless an item occurs twice in the history.
+		// K = number of history items fixed at compile time (0: len at runtime)
+		template <int K, bool MEAN> void learnBasket(int user_id, int nextitem_p, const int* negatives, int num_negatives, const BasketRef& basket, int len) {
+			if (K > 0) {
+				len = K;
+			}
+			const int dim = num_feature;
+			static thread_local std::vector<C> embedding;
+			embedding.resize(2*dim);
+			C* __restrict__ L = &embedding[0];
+			C* __restrict__ M = &embedding[dim];
+			embedBasketK<K>(basket, len, L, M);
+			const bool has_M = ! MEAN && (len > 1);
+			// share of one history row in L and in M
+			const C w_L = MEAN ? (C) 1 / len : (C) 1;
+			const C w_M = has_M ? (C) 1 / (len-1) : (C) 0;
+			const C lr = learn_rate;
+			const C reg_UI = regular_UI, reg_IU = regular_IU, reg_IL = regular_IL, reg_LI = regular_LI, reg_MI = regular_MI, reg_IM = regular_IM;
+
+			T* __restrict__ UI_u = rowOf(V_UI, rows_UI, user_id);
+			T* __restrict__ IU_p = rowOf(V_IU, rows_IU, nextitem_p);
+			T* __restrict__ IL_p = rowOf(V_IL, rows_IL, nextitem_p);
+			T* __restrict__ IM_p = rowOf(V_IM, rows_IM, nextitem_p);
+			for (int j = 0; j < num_negatives; j++) {
+				T* __restrict__ IU_n = rowOf(V_IU, rows_IU, negatives[j]);
+				T* __restrict__ IL_n = rowOf(V_IL, rows_IL, negatives[j]);
+				T* __restrict__ IM_n = rowOf(V_IM, rows_IM, negatives[j]);
+
+				C x_pn = 0;
+				#pragma omp simd reduction(+:x_pn)
+				for (int f = 0; f < dim; f++) {
+					C d = (C) UI_u[f] * ((C) IU_p[f] - (C) IU_n[f]) + L[f] * ((C) IL_p[f] - (C) IL_n[f]);
+					if (has_M) {
+						d += M[f] * ((C) IM_p[f] - (C) IM_n[f]);
+					}
+					x_pn += d;
+				}
+				if (isnan(x_pn)) {
+					throw "Prediction is NAN";
+				}
+				const C normalizer = BasketLearner::partial_loss(loss_function, x_pn);
+				const uint32_t seed = roundingSeed();
+
+				// the history rows first, while V_IL and V_IM hold the values from before this step
+				for (int p = 0; p < len; p++) {
+					if (MEAN || (p == 0)) {
+						T* __restrict__ LI_r = rowOf(V_LI, rows_LI, basket[p]);
+						#pragma omp simd
+						for (int f = 0; f < dim; f++) {
+							C LI_r_f = LI_r[f];
+							storeUpdate(LI_r[f], LI_r_f + lr * (normalizer * w_L * ((C) IL_p[f] - (C) IL_n[f]) - reg_LI * LI_r_f), roundingNoise(seed, 8*(dim*(p+1) + f)));
+						}
+					} else {
+						T* __restrict__ MI_r = rowOf(V_MI, rows_MI, basket[p]);
+						#pragma omp simd
+						for (int f = 0; f < dim; f++) {
+							C MI_r_f = MI_r[f];
+							storeUpdate(MI_r[f], MI_r_f + lr * (normalizer * w_M * ((C) IM_p[f] - (C) IM_n[f]) - reg_MI * MI_r_f), roundingNoise(seed, 8*(dim*(p+1) + f)));
+						}
+					}
+				}
+				#pragma omp simd
+				for (int f = 0; f < dim; f++) {
+					C UI_u_f = UI_u[f], IU_p_f = IU_p[f], IU_n_f = IU_n[f];
+					C IL_p_f = IL_p[f], IL_n_f = IL_n[f];
+					C L_f = L[f];
+					storeUpdate(UI_u[f], UI_u_f + lr * (normalizer * (IU_p_f - IU_n_f) - reg_UI * UI_u_f), roundingNoise(seed, 8*f + 0));
+					storeUpdate(IU_p[f], IU_p_f + lr * (normalizer * UI_u_f - reg_IU * IU_p_f), roundingNoise(seed, 8*f + 1));
+					storeUpdate(IU_n[f], IU_n_f + lr * (normalizer * (-UI_u_f) - reg_IU * IU_n_f), roundingNoise(seed, 8*f + 2));
+					storeUpdate(IL_p[f], IL_p_f + lr * (normalizer * L_f - reg_IL * IL_p_f), roundingNoise(seed, 8*f + 3));
+					storeUpdate(IL_n[f], IL_n_f + lr * (normalizer * (-L_f) - reg_IL * IL_n_f), roundingNoise(seed, 8*f + 4));
+					// the mean of the updated history rows
+					L[f] = L_f + lr * (normalizer * w_L * (IL_p_f - IL_n_f) - reg_LI * L_f);
+					if (has_M) {
+						C IM_p_f = IM_p[f], IM_n_f = IM_n[f];
+						C M_f = M[f];
+						storeUpdate(IM_p[f], IM_p_f + lr * (normalizer * M_f - reg_IM * IM_p_f), roundingNoise(seed, 8*f + 5));
+						storeUpdate(IM_n[f], IM_n_f + lr * (normalizer * (-M_f) - reg_IM * IM_n_f), roundingNoise(seed, 8*f + 6));
+						M[f] = M_f + lr * (normalizer * w_M * (IM_p_f - IM_n_f) - reg_MI * M_f);
+					}
+				}
+			}
+		}
+
+		template <bool MEAN> void learnBasketDispatch(int user_id, int nextitem_p, const int* negatives, int num_negatives, const BasketRef& basket, int len) {
+			switch (len) {
+				case 2: learnBasket<2, MEAN>(user_id, nextitem_p, negatives, num_negatives, basket, len); break;
+				case 3: learnBasket<3, MEAN>(user_id, nextitem_p, negatives, num_negatives, basket, len); break;
+				case 4: learnBasket<4, MEAN>(user_id, nextitem_p, negatives, num_negatives, basket, len); break;
+				default: learnBasket<0, MEAN>(user_id, nextitem_p, negatives, num_negatives, basket, len); break;
+			}
+		}
+
+		// true if the model reads at most items n-1 (V_LI) and n-2 (V_MI) of the history, which learnFused covers
+		inline bool isFirstOrder(int len) const {
+			return (len == 1) || (! mean_transition && (len == 2));
+		}
+
+		inline virtual void learn(int user_id, int time_id, int nextitem_p, int nextitem_n, const BasketRef& basket) {
+			int len = historyLength(basket);
+			if (! isFirstOrder(len)) {
+				learnNegatives(user_id, time_id, nextitem_p, &nextitem_n, 1, basket);
+			} else if (len > 1) {
+				learnDispatch<true>(user_id, nextitem_p, nextitem_n, basket);
+			} else {
+				learnDispatch<false>(user_id, nextitem_p, nextitem_n, basket);
+			}
+		}
+
+		virtual void learnNegatives(int user_id, int time_id, int nextitem_p, const int* negatives, int num_negatives, const BasketRef& basket) {
+			int len = historyLength(basket);
+			if (isFirstOrder(len)) {
+				for (int j = 0; j < num_negatives; j++) {
+					learn(user_id, time_id, nextitem_p, negatives[j], basket);
+				}
+			} else if (mean_transition) {
+				learnBasketDispatch<true>(user_id, nextitem_p, negatives, num_negatives, basket, len);
+			} else {
+				learnBasketDispatch<false>(user_id, nextitem_p, negatives, num_negatives, basket, len);
+			}
+		}
 
 };
 
+NextBasketRecommenderFPMC* NextBasketRecommenderFPMC::create(const std::string& precision) {
+	if (! precision.compare("double")) {
+		return new NextBasketRecommenderFPMCImpl<double>();
+	} else if (! precision.compare("float")) {
+		return new NextBasketRecommenderFPMCImpl<float>();
+	} else if (! precision.compare("bf16")) {
+		return new NextBasketRecommenderFPMCImpl<bfloat16>();
+	}
+	throw "unknown precision " + precision;
+}
+
+std::string NextBasketRecommenderFPMC::modelPrecision(const std::string& filename) {
+	FPMCModelHeader header;
+	std::ifstream in_file (filename.c_str(), std::ios::in | std::ios::binary);
+	if (! in_file.is_open()) {
+		throw "Unable to open file " + filename;
+	}
+	if (! in_file.read((char*) &header, sizeof(header))) {
+		throw "Not a model file: " + filename;
+	}
+	checkHeader(header, filename);
+	if (header.value_size == sizeof(double)) {
+		return precisionName<double>();
+	} else if (header.value_size == sizeof(float)) {
+		return precisionName<float>();
+	} else if (header.value_size == sizeof(bfloat16)) {
+		return precisionName<bfloat16>();
+	}
+	throw "unsupported value size " + std::to_string(header.value_size) + " in model file " + filename;
+}
+
+bool NextBasketRecommenderFPMC::modelIds(const std::string& filename, IdDictionary& users, IdDictionary& items) {
+	FPMCModelHeader header;
+	std::ifstream in_file (filename.c_str(), std::ios::in | std::ios::binary);
+	if (! in_file.is_open()) {
+		throw "Unable to open file " + filename;
+	}
+	if (! in_file.read((char*) &header, sizeof(header))) {
+		throw "Not a model file: " + filename;
+	}
+	checkHeader(header, filename);
+	if (header.length_ids == 0) {
+		return false;
+	}
+	std::string section(header.length_ids, 0);
+	if (! in_file.seekg(header.offset_ids) || ! in_file.read(&section[0], header.length_ids)) {
+		throw "Truncated model file: " + filename;
+	}
+	readIdSection(header, section.data(), users, items, filename);
+	return true;
+}
+
 #endif /*BASKET_REC_FPMC_H_*/
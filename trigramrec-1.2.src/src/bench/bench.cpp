@@ -0,0 +1,454 @@
+/*
+	Benchmarks for the FPMC tool
+
+	Micro benchmarks time the text parsers (token_reader, SparseFourDimBoolean,
+	BasketCaseDB) on a generated file and the FPMC operations predict, learn,
+	predictTopItems, evaluate and savePrediction for every combination of
+	-dims and -items on generated data. Macro benchmarks load, train, evaluate
+	and predict the cross validation folds found in -data_dir.
+
+	Every result is one row "benchmark dim items value unit" where value is a
+	throughput (higher is better). With -baseline the results are compared to
+	the rows of an earlier TSV result file; the tool exits with 1 if any
+	benchmark got slower by more than -tolerance.
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unistd.h>
+#include "../util/util.h"
+#include "../util/cmdline.h"
+#include "../util/random.h"
+#include "../util/token_reader.h"
+#include "../util/smatrix.h"
+
+#include "../basketrec/src/Data.h"
+#include "../basketrec/src/basket_rec_fpmc.h"
+
+
+struct BenchResult {
+	std::string benchmark;
+	int dim, items;
+	double value;
+	std::string unit;
+};
+
+// redirects std::cout (the library reports its progress there) to /dev/null while alive
+class QuietOutput {
+	private:
+		std::ofstream null_out;
+		std::streambuf* old_buf;
+	public:
+		QuietOutput() {
+			null_out.open("/dev/null");
+			old_buf = std::cout.rdbuf(null_out.rdbuf());
+		}
+		~QuietOutput() {
+			std::cout.rdbuf(old_buf);
+		}
+};
+
+// calls f(n) (n repetitions of an operation that does ops_per_call units of work)
+// with a growing n until one call takes at least min_time seconds; returns units per second
+template <typename F> double throughput(F f, double ops_per_call, double min_time) {
+	long long n = 1;
+	while (true) {
+		double start = getwalltime();
+		f(n);
+		double elapsed = getwalltime() - start;
+		if (elapsed >= min_time) {
+			return n * ops_per_call / elapsed;
+		}
+		long long next_n = (elapsed > 0) ? (long long) (n * 1.2 * min_time / elapsed) : n * 100;
+		n = std::min(std::max(next_n, 2*n), 100*n);
+	}
+}
+
+// writes num_rows cases "user time seqlength item_1 .. item_{seqlength-1} next_item" with popularity skewed items
+void writeCases(const std::string& filename, int num_user, int num_item, int num_rows, Random& rng) {
+	std::ofstream out(filename.c_str());
+	if (! out.is_open()) {
+		throw "Unable to open file " + filename;
+	}
+	for (int r = 0; r < num_rows; r++) {
+		int seqlength = 2 + rng.bounded(3);
+		out << rng.bounded(num_user) << " " << r << " " << seqlength;
+		for (int i = 0; i < seqlength; i++) {
+			double x = rng.uniform();
+			out << " " << std::min(num_item-1, (int) (num_item * x * x * x));
+		}
+		out << "\n";
+	}
+}
+
+class Benchmark {
+	public:
+		std::vector<BenchResult> results;
+		double min_time;
+		int num_threads;
+		std::string precision;
+		std::string tmp_prefix;
+
+		void add(const std::string& benchmark, int dim, int items, double value, const std::string& unit) {
+			BenchResult result;
+			result.benchmark = benchmark;
+			result.dim = dim;
+			result.items = items;
+			result.value = value;
+			result.unit = unit;
+			results.push_back(result);
+			std::cerr << benchmark << " dim=" << dim << " items=" << items << ": " << value << " " << unit << std::endl;
+		}
+
+		void benchParsers(int num_rows, Random& rng) {
+			std::string filename = tmp_prefix + "parse.txt";
+			writeCases(filename, 1000, 10000, num_rows, rng);
+			long long num_values = 0;
+			{
+				std::ifstream in(filename.c_str());
+				token_reader reader(&in);
+				do {
+					reader.readInt();
+					if (! reader.is_missing) {
+						num_values++;
+					}
+				} while (reader.ch != 0);
+			}
+			add("parse/token_reader", 0, 0, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					std::ifstream in(filename.c_str());
+					token_reader reader(&in);
+					do {
+						reader.readInt();
+					} while (reader.ch != 0);
+				}
+			}, num_values, min_time), "values/s");
+			add("parse/SparseFourDimBoolean", 0, 0, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					SparseFourDimBoolean cases;
+					cases.fromFile(filename);
+				}
+			}, num_rows, min_time), "rows/s");
+			add("parse/BasketCaseDB", 0, 0, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					BasketCaseDB cases;
+					cases.fromFile(filename, num_threads);
+				}
+			}, num_rows, min_time), "rows/s");
+			unlink(filename.c_str());
+		}
+
+		NextBasketRecommenderFPMC* createModel(int dim, int num_user, int num_item) {
+			NextBasketRecommenderFPMC* fpmc = NextBasketRecommenderFPMC::create(precision);
+			fpmc->loss_function = LOSS_FUNCTION_LN_SIGMOID;
+			fpmc->learn_rate = 0.01;
+			fpmc->num_neg_samples = 10;
+			fpmc->num_iterations = 1;
+			fpmc->sampler = "uniform";
+			fpmc->sampler_lambda = 0.1;
+			fpmc->num_user = num_user;
+			fpmc->num_item = num_item;
+			fpmc->num_feature = dim;
+			fpmc->init_mean = 0;
+			fpmc->init_stdev = 0.01;
+			fpmc->regular_UI = fpmc->regular_IU = fpmc->regular_IL = fpmc->regular_LI = 0.01;
+			fpmc->regular_MI = fpmc->regular_IM = 0.01;
+			fpmc->num_threads = num_threads;
+			fpmc->N = 10;
+			fpmc->init();
+			return fpmc;
+		}
+
+		// predict, predictTopItems, evaluate, savePrediction and learn on one generated dataset
+		void benchModel(Dataset& dataset, int dim, int num_item) {
+			NextBasketRecommenderFPMC* fpmc;
+			{
+				QuietOutput quiet;
+				fpmc = createModel(dim, dataset.max_user_id+1, num_item);
+			}
+			const BasketCaseDB& train = dataset.data;
+			const BasketCaseDB& test = dataset.test_data;
+			Random rng(1, dim);
+
+			volatile double sink = 0;
+			add("fpmc/predict", dim, num_item, throughput([&](long long n) {
+				double sum = 0;
+				for (long long i = 0; i < n; i++) {
+					int c = i % test.size();
+					sum += fpmc->predict(test.user_id[c], test.time_id[c], rng.bounded(num_item), test.basket(c));
+				}
+				sink = sum;
+			}, 1, min_time), "calls/s");
+
+			fpmc->prepareScoring();
+			std::vector<double> scores(num_item);
+			std::vector<WeightedItem> top(fpmc->N);
+			add("fpmc/predictTopItems", dim, num_item, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					int c = i % test.size();
+					fpmc->predictTopItems(test.user_id[c], test.time_id[c], test.basket(c), num_item, &top[0], fpmc->N, &scores[0]);
+				}
+			}, 1, min_time), "queries/s");
+
+			add("fpmc/evaluate", dim, num_item, throughput([&](long long n) {
+				QuietOutput quiet;
+				for (long long i = 0; i < n; i++) {
+					sink = fpmc->evaluate(&dataset);
+				}
+			}, test.size(), min_time), "rows/s");
+
+			std::string filename = tmp_prefix + "prediction.txt";
+			add("fpmc/savePrediction", dim, num_item, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					fpmc->savePrediction(test, filename, num_item, 10);
+				}
+			}, test.size(), min_time), "rows/s");
+			unlink(filename.c_str());
+
+			add("fpmc/learn", dim, num_item, throughput([&](long long n) {
+				for (long long i = 0; i < n; i++) {
+					int c = i % train.size();
+					int nextitem_n;
+					do {
+						nextitem_n = rng.bounded(num_item);
+					} while (nextitem_n == train.next_item[c]);
+					fpmc->learn(train.user_id[c], train.time_id[c], train.next_item[c], nextitem_n, train.basket(c));
+				}
+			}, 1, min_time), "calls/s");
+			delete fpmc;
+		}
+
+		void benchModels(const std::vector<int>& dims, const std::vector<int>& items, int num_rows, double max_mb, Random& rng) {
+			const int num_user = 1000;
+			for (uint i = 0; i < items.size(); i++) {
+				int num_item = items[i];
+				// keep a full evaluation of the test file around 1e6 scored items
+				int num_test_rows = std::max(20, 1000000 / num_item);
+				std::string train_filename = tmp_prefix + "train.txt";
+				std::string test_filename = tmp_prefix + "test.txt";
+				writeCases(train_filename, num_user, num_item, num_rows, rng);
+				writeCases(test_filename, num_user, num_item, num_test_rows, rng);
+				QuietOutput* quiet = new QuietOutput();
+				Dataset dataset(train_filename, false, num_threads);
+				dataset.loadTestSplit(test_filename);
+				delete quiet;
+				unlink(train_filename.c_str());
+				unlink(test_filename.c_str());
+				dataset.max_user_id = num_user-1;
+				dataset.max_item_id = num_item-1;
+				for (uint d = 0; d < dims.size(); d++) {
+					// user, IU, IL, IM, LI and MI factors plus a snapshot of the item factors
+					double mb = ((double) num_user + 8.0 * num_item) * dims[d] * sizeof(double) / (1024.0 * 1024.0);
+					if (mb > max_mb) {
+						std::cerr << "skipping dim=" << dims[d] << " items=" << num_item << ": about " << (int) mb << " MB > -max_mb" << std::endl;
+						continue;
+					}
+					benchModel(dataset, dims[d], num_item);
+				}
+			}
+		}
+
+		// load, train (one iteration), evaluate and predict one cross validation fold
+		void benchFold(const std::string& name, const std::string& train_filename, const std::string& test_filename, int dim) {
+			QuietOutput* quiet = new QuietOutput();
+			double start = getwalltime();
+			Dataset dataset(train_filename, false, num_threads);
+			dataset.loadTestSplit(test_filename);
+			double load_time = getwalltime() - start;
+			NextBasketRecommenderFPMC* fpmc = createModel(dim, dataset.max_user_id+1, dataset.max_item_id+1);
+			fpmc->eval_every = 1;
+			fpmc->keep_best = false;
+			start = getwalltime();
+			fpmc->train(dataset);
+			double train_time = getwalltime() - start;
+			start = getwalltime();
+			fpmc->evaluate(&dataset);
+			double evaluate_time = getwalltime() - start;
+			std::string filename = tmp_prefix + "prediction.txt";
+			start = getwalltime();
+			fpmc->savePrediction(dataset.test_data, filename, dataset.max_item_id+1, 10);
+			double predict_time = getwalltime() - start;
+			unlink(filename.c_str());
+			delete quiet;
+
+			int num_item = dataset.max_item_id+1;
+			double num_rows = dataset.data.size() + dataset.test_data.size();
+			add("macro/" + name + "/load", dim, num_item, num_rows / load_time, "rows/s");
+			// train() includes the evaluation after the iteration
+			add("macro/" + name + "/train", dim, num_item, (double) dataset.data.size() * fpmc->num_neg_samples / train_time, "samples/s");
+			add("macro/" + name + "/evaluate", dim, num_item, dataset.test_data.size() / evaluate_time, "rows/s");
+			add("macro/" + name + "/savePrediction", dim, num_item, dataset.test_data.size() / predict_time, "rows/s");
+			delete fpmc;
+		}
+
+		void benchFolds(const std::string& data_dir, int num_folds, int dim) {
+			const char* datatypes[] = { "android", "ipad" };
+			for (int t = 0; t < 2; t++) {
+				for (int index = 1; index <= num_folds; index++) {
+					std::ostringstream suffix;
+					suffix << "_seq_" << index << ".txt";
+					std::string train_filename = data_dir + "/train/" + datatypes[t] + "_train" + suffix.str();
+					std::string test_filename = data_dir + "/test/" + datatypes[t] + "_test" + suffix.str();
+					if ((access(train_filename.c_str(), R_OK) != 0) || (access(test_filename.c_str(), R_OK) != 0)) {
+						continue;
+					}
+					std::ostringstream name;
+					name << datatypes[t] << "_" << index;
+					benchFold(name.str(), train_filename, test_filename, dim);
+				}
+			}
+		}
+
+		void save(std::ostream& out, const std::string& format) {
+			if (! format.compare("json")) {
+				out << "[" << std::endl;
+				for (uint i = 0; i < results.size(); i++) {
+					out << "  {\"benchmark\": \"" << results[i].benchmark << "\", \"dim\": " << results[i].dim << ", \"items\": " << results[i].items
+						<< ", \"value\": " << results[i].value << ", \"unit\": \"" << results[i].unit << "\"}" << ((i+1 < results.size()) ? "," : "") << std::endl;
+				}
+				out << "]" << std::endl;
+			} else if (! format.compare("tsv")) {
+				out << "benchmark\tdim\titems\tvalue\tunit" << std::endl;
+				for (uint i = 0; i < results.size(); i++) {
+					out << results[i].benchmark << "\t" << results[i].dim << "\t" << results[i].items << "\t" << results[i].value << "\t" << results[i].unit << std::endl;
+				}
+			} else {
+				throw "unknown format " + format;
+			}
+		}
+
+		// reports every benchmark that is slower than (1-tolerance) * baseline on std::cerr (stdout may be the
+		// result file); returns the number of regressions
+		int compare(const std::string& filename, double tolerance) {
+			std::ifstream in(filename.c_str());
+			if (! in.is_open()) {
+				throw "Unable to open file " + filename;
+			}
+			std::map<std::string, double> baseline;
+			std::string line;
+			while (std::getline(in, line)) {
+				std::istringstream fields(line);
+				std::string benchmark, dim, items;
+				double value;
+				if ((fields >> benchmark >> dim >> items >> value) && benchmark.compare("benchmark")) {
+					baseline[benchmark + " dim=" + dim + " items=" + items] = value;
+				}
+			}
+			int num_regressions = 0;
+			std::cerr << "Comparison with " << filename << " (tolerance " << tolerance * 100 << "%):" << std::endl;
+			for (uint i = 0; i < results.size(); i++) {
+				std::ostringstream key;
+				key << results[i].benchmark << " dim=" << results[i].dim << " items=" << results[i].items;
+				std::map<std::string, double>::const_iterator base = baseline.find(key.str());
+				if (base == baseline.end() || ! (base->second > 0)) {
+					std::cerr << "  new         " << key.str() << std::endl;
+					continue;
+				}
+				double change = results[i].value / base->second - 1.0;
+				bool is_regression = (change < -tolerance);
+				if (is_regression) {
+					num_regressions++;
+				}
+				std::cerr << (is_regression ? "  REGRESSION  " : "  ok          ") << key.str() << ": " << results[i].value << " vs " << base->second
+					<< " " << results[i].unit << " (" << (change >= 0 ? "+" : "") << change * 100 << "%)" << std::endl;
+			}
+			std::cerr << num_regressions << " regression(s)" << std::endl;
+			return num_regressions;
+		}
+};
+
+
+int main(int argc, char **argv) {
+
+	try {
+		CMDLine cmdline(argc, argv);
+		std::cerr << "FPMC benchmarks" << std::endl;
+		std::cerr << "----------------------------------------------------------------------------" << std::endl;
+
+		const std::string param_out		= cmdline.registerParameter("out", "filename for the results; default=stdout");
+		const std::string param_format		= cmdline.registerParameter("format", "'tsv' or 'json'; default=tsv");
+		const std::string param_baseline	= cmdline.registerParameter("baseline", "TSV result file of an earlier run; benchmarks slower than the baseline by more than -tolerance are reported and the exit code is 1");
+		const std::string param_tolerance	= cmdline.registerParameter("tolerance", "allowed relative slowdown against -baseline; default=0.1");
+		const std::string param_dims		= cmdline.registerParameter("dims", "factor dimensions of the model benchmarks; default=16,32,64,128,256");
+		const std::string param_items		= cmdline.registerParameter("items", "catalogue sizes of the model benchmarks; default=1000,10000,100000");
+		const std::string param_rows		= cmdline.registerParameter("rows", "number of generated training rows; default=50000");
+		const std::string param_max_mb		= cmdline.registerParameter("max_mb", "skip model benchmarks needing more memory for the factors (MB); default=1024");
+		const std::string param_min_time	= cmdline.registerParameter("min_time", "minimal time of one measurement in seconds; default=0.2");
+		const std::string param_data_dir	= cmdline.registerParameter("data_dir", "directory with the train/ and test/ folds of the macro benchmarks; default=../cross_validation");
+		const std::string param_folds		= cmdline.registerParameter("folds", "number of folds per dataset of the macro benchmarks, 0 = none; default=5");
+		const std::string param_quick		= cmdline.registerParameter("quick", "short run: dims 16,64, items 1000,10000, one fold, min_time 0.05");
+		const std::string param_precision	= cmdline.registerParameter("precision", "storage of the factors: 'double', 'float' or 'bf16'; default=double");
+		const std::string param_threads		= cmdline.registerParameter("threads", "number of worker threads; default=1");
+		const std::string param_seed		= cmdline.registerParameter("seed", "seed for the generated data; default=1");
+		const std::string param_help            = cmdline.registerParameter("help", "this screen");
+
+		if (cmdline.hasParameter(param_help)) {
+			cmdline.print_help();
+			return 0;
+		}
+		cmdline.checkParameters();
+
+		bool quick = cmdline.hasParameter(param_quick);
+		ran_seed(cmdline.getValue(param_seed, 1));
+		Random rng(ran_global().next());
+
+		Benchmark bench;
+		bench.min_time = cmdline.getValue(param_min_time, quick ? 0.05 : 0.2);
+		bench.num_threads = cmdline.getValue(param_threads, 1);
+		bench.precision = cmdline.getValue(param_precision, std::string("double"));
+		std::ostringstream tmp_prefix;
+		tmp_prefix << "/tmp/fpmc_bench_" << getpid() << "_";
+		bench.tmp_prefix = tmp_prefix.str();
+
+		std::vector<int> dims, items;
+		if (cmdline.hasParameter(param_dims)) {
+			dims = cmdline.getIntValues(param_dims);
+		} else if (quick) {
+			dims.push_back(16); dims.push_back(64);
+		} else {
+			dims.push_back(16); dims.push_back(32); dims.push_back(64); dims.push_back(128); dims.push_back(256);
+		}
+		if (cmdline.hasParameter(param_items)) {
+			items = cmdline.getIntValues(param_items);
+		} else {
+			items.push_back(1000); items.push_back(10000);
+			if (! quick) {
+				items.push_back(100000);
+			}
+		}
+		int num_rows = cmdline.getValue(param_rows, quick ? 10000 : 50000);
+
+		bench.benchParsers(num_rows, rng);
+		bench.benchModels(dims, items, num_rows, cmdline.getValue(param_max_mb, 1024.0), rng);
+		bench.benchFolds(cmdline.getValue(param_data_dir, std::string("../cross_validation")), cmdline.getValue(param_folds, quick ? 1 : 5), 64);
+
+		const std::string format = cmdline.getValue(param_format, std::string("tsv"));
+		if (cmdline.hasParameter(param_out)) {
+			std::ofstream out_file(cmdline.getValue(param_out).c_str());
+			if (! out_file.is_open()) {
+				throw "Unable to open file " + cmdline.getValue(param_out);
+			}
+			bench.save(out_file, format);
+		} else {
+			bench.save(std::cout, format);
+		}
+
+		if (cmdline.hasParameter(param_baseline)) {
+			if (bench.compare(cmdline.getValue(param_baseline), cmdline.getValue(param_tolerance, 0.1)) > 0) {
+				return 1;
+			}
+		}
+
+	} catch (std::string &e) {
+		std::cerr << e << std::endl;
+		return 1;
+	}
+
+}
@@ -0,0 +1,121 @@
+/*
+	Cache-line aligned memory
+
+	allocate() returns memory aligned to 64 bytes. With huge_pages the block
+	is an anonymous mapping aligned to 2MB and marked for transparent huge
+	pages, so large factor tables need fewer TLB entries; if the kernel does
+	not give huge pages the memory simply stays in normal pages. With shared the
+	block is a POSIX shared memory segment that forked processes keep sharing;
+	its name is removed right after mapping, so nothing is left behind when the
+	processes end. Shared memory gets huge pages the same way (if the kernel
+	allows them for shmem, see /sys/kernel/mm/transparent_hugepage/shmem_enabled).
+*/
+
+#ifndef ALIGNED_BUFFER_H_
+#define ALIGNED_BUFFER_H_
+
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const size_t CACHE_LINE_SIZE = 64;
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+class AlignedBuffer {
+	private:
+		char* data;
+		// start and length of the mapping if the buffer uses huge pages or shared memory
+		char* mapping;
+		size_t mapping_length;
+
+		// a mapping of length bytes that still holds them after aligning its start to a huge page
+		static size_t hugePageMappingLength(size_t length) {
+			return (length + 2 * HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		}
+		// moves data to the first huge page boundary of the mapping and marks the rest for huge pages
+		void adviseHugePages() {
+			data = (char*) (((uintptr_t) mapping + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+			madvise(data, mapping_length - (data - mapping), MADV_HUGEPAGE);
+		}
+
+		AlignedBuffer(const AlignedBuffer&);
+		AlignedBuffer& operator=(const AlignedBuffer&);
+	public:
+		AlignedBuffer() {
+			data = NULL;
+			mapping = NULL;
+			mapping_length = 0;
+		}
+		~AlignedBuffer() {
+			release();
+		}
+
+		char* begin() { return data; }
+
+		void allocate(size_t length, bool huge_pages, bool shared = false) {
+			release();
+			length = std::max(length, (size_t) 1);
+			if (shared) {
+				static int num_segments = 0;
+				std::string name = "/basketrec." + std::to_string(getpid()) + "." + std::to_string(num_segments++);
+				int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+				if (fd < 0) {
+					throw "Unable to create shared memory " + name;
+				}
+				shm_unlink(name.c_str());
+				mapping_length = huge_pages ? hugePageMappingLength(length) : length;
+				void* p = MAP_FAILED;
+				if (ftruncate(fd, mapping_length) == 0) {
+					p = mmap(NULL, mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				}
+				close(fd);
+				if (p == MAP_FAILED) {
+					mapping_length = 0;
+					throw std::string("Unable to allocate shared memory");
+				}
+				mapping = (char*) p;
+				data = mapping;
+				if (huge_pages) {
+					adviseHugePages();
+				}
+			} else if (huge_pages) {
+				mapping_length = hugePageMappingLength(length);
+				void* p = mmap(NULL, mapping_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (p == MAP_FAILED) {
+					mapping_length = 0;
+					throw std::string("Unable to allocate memory");
+				}
+				mapping = (char*) p;
+				adviseHugePages();
+			} else {
+				void* p = NULL;
+				if (posix_memalign(&p, CACHE_LINE_SIZE, length) != 0) {
+					throw std::string("Unable to allocate memory");
+				}
+				data = (char*) p;
+			}
+		}
+
+		void release() {
+			if (mapping != NULL) {
+				munmap(mapping, mapping_length);
+			} else if (data != NULL) {
+				free(data);
+			}
+			data = NULL;
+			mapping = NULL;
+			mapping_length = 0;
+		}
+};
+
+// number of values of type T in a row of length values padded to whole cache lines
+template <typename T> inline unsigned paddedRowLength(unsigned length) {
+	return (length * sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE / sizeof(T);
+}
+
+#endif /*ALIGNED_BUFFER_H_*/
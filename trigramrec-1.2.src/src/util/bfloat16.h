@@ -0,0 +1,83 @@
+/*
+	bfloat16 storage type
+
+	The upper half of an IEEE float: the exponent range of float with an 8 bit
+	mantissa. Values are rounded to nearest even when stored; all arithmetic
+	is done in float (see ComputeType). SGD updates are stored with
+	storeUpdate(), which rounds bf16 stochastically: a step like the weight
+	decay lr*reg*w is far below half an ulp and would always round away.
+*/
+
+#ifndef BFLOAT16_H_
+#define BFLOAT16_H_
+
+#include <stdint.h>
+#include <cstring>
+
+struct bfloat16 {
+	uint16_t bits;
+
+	bfloat16() {}
+	bfloat16(float f) { bits = fromFloat(f); }
+	// assigns in place (no temporary), which keeps conversion loops vectorizable
+	bfloat16& operator=(float f) {
+		bits = fromFloat(f);
+		return *this;
+	}
+
+	static inline uint16_t fromFloat(float f) {
+		uint32_t u;
+		memcpy(&u, &f, sizeof(u));
+		// branch free; NaN stays a (quiet) NaN
+		uint32_t rounded = (u + 0x7FFF + ((u >> 16) & 1)) >> 16;
+		uint32_t quiet_nan = (u >> 16) | 0x0040;
+		return ((u & 0x7FFFFFFF) > 0x7F800000) ? quiet_nan : rounded;
+	}
+	// rounds up with probability (dropped bits)/2^16, so the stored value is exact in expectation;
+	// random supplies the 16 bits
+	static inline uint16_t fromFloatStochastic(float f, uint32_t random) {
+		uint32_t u;
+		memcpy(&u, &f, sizeof(u));
+		uint32_t rounded = (u + (random & 0xFFFF)) >> 16;
+		uint32_t quiet_nan = (u >> 16) | 0x0040;
+		return ((u & 0x7FFFFFFF) > 0x7F800000) ? quiet_nan : rounded;
+	}
+	operator float() const {
+		uint32_t u = (uint32_t) bits << 16;
+		float f;
+		memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+};
+
+// type in which values stored as T are accumulated
+template <typename T> struct ComputeType { typedef T type; };
+template <> struct ComputeType<bfloat16> { typedef float type; };
+
+// per thread seed for the rounding noise of one SGD step
+inline uint32_t roundingSeed() {
+	static thread_local uint32_t counter = 0;
+	counter += 0x9E3779B9;
+	return counter;
+}
+// 32 random bits for element index of the step with seed (integer hash, vectorizable)
+inline uint32_t roundingNoise(uint32_t seed, uint32_t index) {
+	uint32_t x = seed ^ (index * 0x85EBCA6B);
+	x ^= x >> 16;
+	x *= 0x7FEB352D;
+	x ^= x >> 15;
+	x *= 0x846CA68B;
+	x ^= x >> 16;
+	return x;
+}
+// stores an SGD update computed in ComputeType<T>; only bf16 uses the noise
+template <typename T, typename C> inline void storeUpdate(T& dst, C value, uint32_t) { dst = value; }
+inline void storeUpdate(bfloat16& dst, float value, uint32_t random) { dst.bits = bfloat16::fromFloatStochastic(value, random); }
+
+// name used by -precision and in messages
+template <typename T> inline const char* precisionName();
+template <> inline const char* precisionName<double>() { return "double"; }
+template <> inline const char* precisionName<float>() { return "float"; }
+template <> inline const char* precisionName<bfloat16>() { return "bf16"; }
+
+#endif /*BFLOAT16_H_*/
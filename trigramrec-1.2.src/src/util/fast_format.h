@@ -0,0 +1,26 @@
+/*
+	Fast formatting of numbers into string buffers
+
+	std::to_chars writes without locales or stream state; appendDouble gives
+	the same text as std::ostream << x with the default precision 6 (%g).
+*/
+
+#ifndef FAST_FORMAT_H_
+#define FAST_FORMAT_H_
+
+#include <string>
+#include <charconv>
+
+inline void appendInt(std::string& out, long long x) {
+	char buffer[24];
+	std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), x);
+	out.append(buffer, result.ptr - buffer);
+}
+
+inline void appendDouble(std::string& out, double x) {
+	char buffer[32];
+	std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), x, std::chars_format::general, 6);
+	out.append(buffer, result.ptr - buffer);
+}
+
+#endif /*FAST_FORMAT_H_*/
@@ -0,0 +1,124 @@
+/*
+	Fast parsing of whitespace separated integers from memory
+
+	A mapped text file is split into chunks at line boundaries so that every
+	chunk can be parsed by its own thread. scanInt reads eight bytes at a time
+	(SWAR): it finds the length of the digit run with a few word operations and
+	converts up to eight digits with three multiplications. scanToken reads raw
+	ids that are not numbers.
+*/
+
+#ifndef FAST_PARSER_H_
+#define FAST_PARSER_H_
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+inline bool isLineEnd(char ch) {
+	return (ch == '\n') || (ch == '\r');
+}
+
+inline bool isDigit(char ch) {
+	return (ch >= '0') && (ch <= '9');
+}
+
+// number of leading (lowest address) ASCII digits in the 8 bytes of v
+inline int countDigits8(uint64_t v) {
+	// a byte is a digit iff its high nibble is 3 and adding 6 keeps it 3
+	uint64_t non_digit = ((v & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL)
+		| (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL);
+	if (non_digit == 0) {
+		return 8;
+	}
+	return __builtin_ctzll(non_digit) / 8;
+}
+
+// value of the first num_digits (1..8) digits in the 8 bytes of v
+inline uint64_t parseDigits8(uint64_t v, int num_digits) {
+	// left-align the digits; the vacated low bytes act as leading zeros
+	v = (v - 0x3030303030303030ULL) << (8 * (8 - num_digits));
+	v = (v * 10) + (v >> 8);
+	v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+		+ (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+	return v;
+}
+
+// skips separators and reads one integer; returns false (and leaves p at the line end) if the line has no more values
+inline bool scanInt(const char*& p, const char* end, long long& x) {
+	// like token_reader, every character that cannot start a number separates values
+	while ((p < end) && ! isDigit(*p) && (*p != '-') && ! isLineEnd(*p)) {
+		p++;
+	}
+	if ((p >= end) || isLineEnd(*p)) {
+		return false;
+	}
+	bool is_negative = false;
+	if (*p == '-') {
+		is_negative = true;
+		p++;
+	}
+	uint64_t result = 0;
+	while (p + 8 <= end) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		int num_digits = countDigits8(v);
+		if (num_digits == 0) {
+			break;
+		}
+		static const uint64_t scale[9] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+		result = result * scale[num_digits] + parseDigits8(v, num_digits);
+		p += num_digits;
+		if (num_digits < 8) {
+			x = is_negative ? -(long long) result : (long long) result;
+			return true;
+		}
+	}
+	while ((p < end) && isDigit(*p)) {
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+	x = is_negative ? -(long long) result : (long long) result;
+	return true;
+}
+
+// skips blanks and reads one token of non-blank characters into [token, token+length); returns
+// false (and leaves p at the line end) if the line has no more tokens
+inline bool scanToken(const char*& p, const char* end, const char*& token, int& length) {
+	while ((p < end) && ((*p == ' ') || (*p == '\t'))) {
+		p++;
+	}
+	if ((p >= end) || isLineEnd(*p)) {
+		return false;
+	}
+	token = p;
+	while ((p < end) && (*p != ' ') && (*p != '\t') && ! isLineEnd(*p)) {
+		p++;
+	}
+	length = p - token;
+	return true;
+}
+
+// moves p behind the end of the current line
+inline const char* nextLine(const char* p, const char* end) {
+	const char* nl = (const char*) memchr(p, '\n', end - p);
+	return (nl == NULL) ? end : nl + 1;
+}
+
+// splits [begin, end) into num_chunks ranges [bounds[i], bounds[i+1]) that start at line beginnings
+inline std::vector<const char*> splitAtLines(const char* begin, const char* end, int num_chunks) {
+	std::vector<const char*> bounds(1, begin);
+	for (int i = 1; i < num_chunks; i++) {
+		const char* p = begin + (end - begin) * i / num_chunks;
+		if (p > bounds.back()) {
+			p = nextLine(p - 1, end);
+		} else {
+			p = bounds.back();
+		}
+		bounds.push_back(p);
+	}
+	bounds.push_back(end);
+	return bounds;
+}
+
+#endif /*FAST_PARSER_H_*/
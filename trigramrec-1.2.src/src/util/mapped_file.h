@@ -0,0 +1,72 @@
+/*
+	Memory-mapped files
+
+	The whole file is mapped private and writable: pages are shared with the
+	page cache (and with every other process mapping the same file) until they
+	are written to.
+*/
+
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class MappedFile {
+	private:
+		char* data;
+		size_t length;
+
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+	public:
+		MappedFile() {
+			data = NULL;
+			length = 0;
+		}
+		~MappedFile() {
+			close();
+		}
+
+		bool isOpen() const { return data != NULL; }
+		const char* begin() const { return data; }
+		char* begin() { return data; }
+		size_t size() const { return length; }
+
+		void open(const std::string& filename) {
+			close();
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if (fd < 0) {
+				throw "Unable to open file " + filename;
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				::close(fd);
+				throw "Unable to stat file " + filename;
+			}
+			length = st.st_size;
+			if (length > 0) {
+				void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+				if (p == MAP_FAILED) {
+					::close(fd);
+					length = 0;
+					throw "Unable to map file " + filename;
+				}
+				data = (char*) p;
+			}
+			::close(fd);
+		}
+
+		void close() {
+			if (data != NULL) {
+				munmap(data, length);
+				data = NULL;
+			}
+			length = 0;
+		}
+};
+
+#endif /*MAPPED_FILE_H_*/
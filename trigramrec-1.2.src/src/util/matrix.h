@@ -15,10 +15,32 @@
 #include <math.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include "../util/random.h"
+#include "../util/thread_pool.h"
 
 
 template <typename T> class DMatrix {
+	private:
+		// true if the rows point into memory owned by someone else (see setExternal)
+		bool is_external;
+		// row blocks appended by grow()
+		std::vector<T*> grown_blocks;
+
+		void release() {
+			if (value != NULL) {
+				if (! is_external) {
+					delete [] value[0];
+				}
+				delete [] value;
+				value = NULL;
+			}
+			for (uint i = 0; i < grown_blocks.size(); i++) {
+				delete [] grown_blocks[i];
+			}
+			grown_blocks.clear();
+			is_external = false;
+		}
 	public:
 		std::vector<std::string> col_names;
 		uint dim1, dim2;
@@ -33,6 +55,7 @@ template <typename T> class DMatrix {
 			dim1 = 0;
 			dim2 = 0;	
 			value = NULL;
+			is_external = false;
 			setSize(p_dim1, p_dim2);
 		}
 		
@@ -40,20 +63,71 @@ template <typename T> class DMatrix {
 			dim1 = 0;
 			dim2 = 0;	
 			value = NULL;
+			is_external = false;
 		}
 		
 		~DMatrix() {
-			if (value != NULL) {
-				delete [] value[0];
-				delete [] value;
-			}	
+			release();
 		}
 		
-		void setSize(uint p_dim1, uint p_dim2) {
-			if (value != NULL) {
-				delete [] value[0];
-				delete [] value;
+		// rows x of the matrix are data + x * row_stride; the memory is not freed by the matrix
+		void setExternal(uint p_dim1, uint p_dim2, T* data, uint row_stride) {
+			release();
+			dim1 = p_dim1;
+			dim2 = p_dim2;
+			value = new T*[std::max(dim1, 1u)];
+			value[0] = data;
+			for (unsigned i = 1; i < dim1; i++) {
+				value[i] = data + (size_t) i * row_stride;
+			}
+			is_external = true;
+			col_names.resize(dim2);
+		}
+
+		bool isExternal() const { return is_external; }
+
+		// distance between consecutive rows; only meaningful while all rows are equally spaced (not after grow)
+		size_t rowStride() const {
+			return (dim1 > 1) ? (size_t) (value[1] - value[0]) : dim2;
+		}
+
+		// true if row x is value[0] + x * rowStride() for every x
+		bool isStrided() const {
+			if (value == NULL) {
+				return false;
+			}
+			size_t stride = rowStride();
+			for (uint i = 1; i < dim1; i++) {
+				if (value[i] != value[0] + i * stride) {
+					return false;
+				}
 			}
+			return true;
+		}
+
+		// appends the rows dim1..p_dim1-1 in a new block; the existing rows are not moved
+		void grow(uint p_dim1) {
+			if (p_dim1 <= dim1) {
+				return;
+			}
+			if ((value == NULL) || (dim1 == 0)) {
+				setSize(p_dim1, dim2);
+				return;
+			}
+			T** new_value = new T*[p_dim1];
+			std::copy(value, value + dim1, new_value);
+			T* block = new T[(size_t) (p_dim1 - dim1) * dim2];
+			for (unsigned i = dim1; i < p_dim1; i++) {
+				new_value[i] = block + (size_t) (i - dim1) * dim2;
+			}
+			grown_blocks.push_back(block);
+			delete [] value;
+			value = new_value;
+			dim1 = p_dim1;
+		}
+
+		void setSize(uint p_dim1, uint p_dim2) {
+			release();
 			dim1 = p_dim1;
 			dim2 = p_dim2;
 			value = new T*[dim1];
@@ -170,24 +244,45 @@ template <typename T> class DVector {
 };
 
 
-class DMatrixDouble : public DMatrix<double> {
-	public:
-		void init(double mean, double stdev) {	
-			for (uint i_1 = 0; i_1 < dim1; i_1++) {
-				for (uint i_2 = 0; i_2 < dim2; i_2++) {
+// matrix of floating point values (double, float or bfloat16) with random initialisation
+template <typename T> class DMatrixReal : public DMatrix<T> {
+	private:
+		// row i is drawn from its own stream (seed, i), so the values do not depend on the number of threads
+		void init_range(double mean, double stdev, uint64_t seed, uint row_begin, uint row_end) {
+			for (uint i_1 = row_begin; i_1 < row_end; i_1++) {
+				Random rng(seed, i_1);
+				for (uint i_2 = 0; i_2 < this->dim2; i_2++) {
 					do{
-						value[i_1][i_2] = ran_gaussian(mean, stdev);
-					}while(isnan(value[i_1][i_2]));
-					
+						this->value[i_1][i_2] = rng.gaussian(mean, stdev);
+					}while(isnan((double) this->value[i_1][i_2]));
 				}
 			}
 		}
+	public:
+		void init(double mean, double stdev, ThreadPool* pool = NULL) {	
+			init_rows(mean, stdev, 0, pool);
+		}
+		void init_rows(double mean, double stdev, uint first_row, ThreadPool* pool = NULL) {
+			uint64_t seed = ran_global().next();
+			if ((pool == NULL) || (first_row >= this->dim1)) {
+				init_range(mean, stdev, seed, first_row, this->dim1);
+				return;
+			}
+			long long num_rows = this->dim1 - first_row;
+			pool->run([&](int thread_id) {
+				init_range(mean, stdev, seed, first_row + pool->rangeBegin(num_rows, thread_id), first_row + pool->rangeBegin(num_rows, thread_id+1));
+			});
+		}
 		void init_column(double mean, double stdev, int column) {	
-			for (uint i_1 = 0; i_1 < dim1; i_1++) {
-				value[i_1][column] = ran_gaussian(mean, stdev);
+			for (uint i_1 = 0; i_1 < this->dim1; i_1++) {
+				this->value[i_1][column] = ran_gaussian(mean, stdev);
 			}
 		}
 };
 
 
+class DMatrixDouble : public DMatrixReal<double> {
+};
+
+
 #endif /*MATRIX_H_*/
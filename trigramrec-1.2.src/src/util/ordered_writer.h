@@ -0,0 +1,109 @@
+/*
+	Ordered output of blocks produced by several threads
+
+	Every thread formats numbered blocks into its own buffer and hands them to
+	put(); the blocks are written to the file in block order, each with one
+	large write. waitForTurn() blocks a thread that is more than window blocks
+	ahead of the oldest unwritten block, which bounds the memory of the pending
+	blocks.
+*/
+
+#ifndef ORDERED_WRITER_H_
+#define ORDERED_WRITER_H_
+
+#include <string>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+class OrderedWriter {
+	private:
+		int fd;
+		std::string filename;
+		long long next_block;
+		long long window;
+		bool is_failed;
+		std::map<long long, std::string> pending;
+		std::mutex mutex;
+		std::condition_variable cv_written;
+
+		void writeAll(const std::string& data) {
+			const char* p = data.data();
+			size_t left = data.size();
+			while (left > 0) {
+				ssize_t written = ::write(fd, p, left);
+				if (written < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					is_failed = true;
+					cv_written.notify_all();
+					throw "Unable to write file " + filename;
+				}
+				p += written;
+				left -= written;
+			}
+		}
+
+	public:
+		OrderedWriter(const std::string& p_filename, long long p_window) {
+			filename = p_filename;
+			window = std::max(p_window, 1LL);
+			next_block = 0;
+			is_failed = false;
+			fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+				throw "Unable to open file " + filename;
+			}
+		}
+		~OrderedWriter() {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+
+		// waits until block may be produced; false if the output failed and the caller should stop
+		bool waitForTurn(long long block) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_written.wait(lock, [&] { return is_failed || (block < next_block + window); });
+			return ! is_failed;
+		}
+
+		// takes the content of buffer (buffer is left empty) and writes every block that is due
+		void put(long long block, std::string& buffer) {
+			std::lock_guard<std::mutex> lock(mutex);
+			pending[block].swap(buffer);
+			buffer.clear();
+			std::map<long long, std::string>::iterator due;
+			while ((due = pending.find(next_block)) != pending.end()) {
+				writeAll(due->second);
+				pending.erase(due);
+				next_block++;
+			}
+			cv_written.notify_all();
+		}
+
+		// releases all waiting threads after an error in one of the producers
+		void fail() {
+			std::lock_guard<std::mutex> lock(mutex);
+			is_failed = true;
+			cv_written.notify_all();
+		}
+
+		void close() {
+			if (pending.size() > 0) {
+				throw "Unable to write file " + filename + ": blocks are missing";
+			}
+			if (::close(fd) != 0) {
+				fd = -1;
+				throw "Unable to write file " + filename;
+			}
+			fd = -1;
+		}
+};
+
+#endif /*ORDERED_WRITER_H_*/
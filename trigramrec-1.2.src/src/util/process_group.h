@@ -0,0 +1,168 @@
+/*
+	Coordinator and forked worker processes
+
+	start(n) forks n-1 workers; the calling process stays the coordinator
+	(rank 0) and every process continues after start() with its own rank.
+	Each worker is connected to the coordinator by two pipes. In barrier() a
+	worker reports that it has finished its step and waits for the
+	coordinator's decision; the coordinator waits until all workers have
+	reported and then sends the decision with release(). A worker whose
+	coordinator is gone sees end of file and stops; a coordinator whose worker
+	is gone throws.
+*/
+
+#ifndef PROCESS_GROUP_H_
+#define PROCESS_GROUP_H_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+class ProcessGroup {
+	private:
+		// coordinator: pipe ends to and from every worker (index rank-1)
+		std::vector<int> to_worker, from_worker;
+		std::vector<pid_t> workers;
+		// worker: pipe ends to and from the coordinator
+		int to_coordinator, from_coordinator;
+
+		ProcessGroup(const ProcessGroup&);
+		ProcessGroup& operator=(const ProcessGroup&);
+
+		static bool writeByte(int fd, char c) {
+			ssize_t r;
+			do {
+				r = ::write(fd, &c, 1);
+			} while ((r < 0) && (errno == EINTR));
+			return (r == 1);
+		}
+		// false on end of file or error
+		static bool readByte(int fd, char& c) {
+			ssize_t r;
+			do {
+				r = ::read(fd, &c, 1);
+			} while ((r < 0) && (errno == EINTR));
+			return (r == 1);
+		}
+		void closeAll() {
+			for (uint i = 0; i < to_worker.size(); i++) {
+				close(to_worker[i]);
+				close(from_worker[i]);
+			}
+			to_worker.clear();
+			from_worker.clear();
+			if (to_coordinator >= 0) {
+				close(to_coordinator);
+				close(from_coordinator);
+			}
+			to_coordinator = -1;
+			from_coordinator = -1;
+		}
+
+	public:
+		int rank;
+		int num_processes;
+
+		ProcessGroup() {
+			to_coordinator = -1;
+			from_coordinator = -1;
+			rank = 0;
+			num_processes = 1;
+		}
+		~ProcessGroup() {
+			try {
+				finish();
+			} catch (std::string&) {
+			}
+		}
+
+		bool isCoordinator() const { return rank == 0; }
+
+		// forks the workers 1..n-1 and returns the rank of the calling process
+		int start(int n) {
+			num_processes = std::max(n, 1);
+			for (int r = 1; r < num_processes; r++) {
+				int down[2], up[2];
+				if ((pipe(down) != 0) || (pipe(up) != 0)) {
+					throw std::string("Unable to create a pipe");
+				}
+				pid_t pid = fork();
+				if (pid < 0) {
+					throw std::string("Unable to start a worker process");
+				}
+				if (pid == 0) {
+					// keep only the own pipes open, so each worker sees the coordinator's end of file
+					for (uint i = 0; i < to_worker.size(); i++) {
+						close(to_worker[i]);
+						close(from_worker[i]);
+					}
+					to_worker.clear();
+					from_worker.clear();
+					workers.clear();
+					close(down[1]);
+					close(up[0]);
+					from_coordinator = down[0];
+					to_coordinator = up[1];
+					rank = r;
+					return rank;
+				}
+				close(down[0]);
+				close(up[1]);
+				to_worker.push_back(down[1]);
+				from_worker.push_back(up[0]);
+				workers.push_back(pid);
+			}
+			// a worker that exits must not kill the coordinator with SIGPIPE on the next release()
+			signal(SIGPIPE, SIG_IGN);
+			return rank;
+		}
+
+		// worker: reports the end of the step and returns the coordinator's decision (false = stop);
+		// coordinator: waits for all workers and returns true
+		bool barrier() {
+			char c;
+			if (! isCoordinator()) {
+				if (! writeByte(to_coordinator, 'd')) {
+					return false;
+				}
+				return readByte(from_coordinator, c) && (c == 'c');
+			}
+			for (uint i = 0; i < from_worker.size(); i++) {
+				if (! readByte(from_worker[i], c)) {
+					throw "worker process " + std::to_string(i+1) + " terminated";
+				}
+			}
+			return true;
+		}
+
+		// coordinator: lets the workers waiting in barrier() continue or stop
+		void release(bool go_on) {
+			for (uint i = 0; i < to_worker.size(); i++) {
+				writeByte(to_worker[i], go_on ? 'c' : 's');
+			}
+		}
+
+		// coordinator: stops the workers and waits for them; throws if one did not exit cleanly
+		void finish() {
+			closeAll();
+			int num_failed = 0;
+			for (uint i = 0; i < workers.size(); i++) {
+				int status = 0;
+				while ((waitpid(workers[i], &status, 0) < 0) && (errno == EINTR));
+				if (! WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+					num_failed++;
+				}
+			}
+			workers.clear();
+			if (num_failed > 0) {
+				throw std::to_string(num_failed) + " worker process(es) failed";
+			}
+		}
+};
+
+#endif /*PROCESS_GROUP_H_*/
@@ -11,21 +11,91 @@
 #define RANDOM_H_
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <cmath>
+#include <vector>
+
+// xoshiro256** (Blackman & Vigna): 256 bit state, period 2^256-1.
+// Random(seed, stream) gives independent, reproducible streams, e.g. one per
+// thread or one per matrix row; the state is expanded from (seed, stream) with splitmix64.
+class Random {
+	private:
+		uint64_t s[4];
+
+		static inline uint64_t rotl(uint64_t x, int k) {
+			return (x << k) | (x >> (64 - k));
+		}
+		static inline uint64_t splitmix64(uint64_t& x) {
+			uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+	public:
+		Random(uint64_t seed = 0, uint64_t stream = 0) {
+			setSeed(seed, stream);
+		}
+
+		void setSeed(uint64_t seed, uint64_t stream = 0) {
+			uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+			for (int i = 0; i < 4; i++) {
+				s[i] = splitmix64(x);
+			}
+		}
+
+		inline uint64_t next() {
+			uint64_t result = rotl(s[1] * 5, 7) * 9;
+			uint64_t t = s[1] << 17;
+			s[2] ^= s[0];
+			s[3] ^= s[1];
+			s[1] ^= s[2];
+			s[0] ^= s[3];
+			s[2] ^= t;
+			s[3] = rotl(s[3], 45);
+			return result;
+		}
+
+		// uniform in [0, n) without modulo (Lemire's multiply-shift); n < 2^32 only uses the high word
+		inline uint64_t bounded(uint64_t n) {
+			if (n <= 0xFFFFFFFFULL) {
+				return ((next() >> 32) * n) >> 32;
+			}
+			return (uint64_t) (((unsigned __int128) next() * n) >> 64);
+		}
+
+		// uniform in [0, 1) with 53 random bits
+		inline double uniform() {
+			return (next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		double gaussian();
+		double gaussian(double mean, double stdev);
+};
+
+// the generator behind the ran_* functions; every thread has its own, so threads that run
+// independent jobs (e.g. cross validation folds) seed theirs with ran_seed; hot loops use their own Random
+Random& ran_global() {
+	static thread_local Random generator;
+	return generator;
+}
+
+void ran_seed(uint64_t seed) {
+	ran_global().setSeed(seed);
+}
 
 double ran_gaussian();
 double ran_gaussian(double mean, double stdev);
 double ran_uniform();
 double ran_exp();			
 
-double ran_gaussian() {
+double Random::gaussian() {
 	// method from Joseph L. Leva: "A fast normal Random number generator"
 	double u,v, x, y, Q;
 	do {
 		do {
-			u = ran_uniform();
+			u = uniform();
 		} while (u == 0.0); 
-		v = 1.7156 * (ran_uniform() - 0.5);
+		v = 1.7156 * (uniform() - 0.5);
 		x = u - 0.449871;
 		y = std::abs(v) + 0.386595;
 		Q = x*x + y*(0.19600*y-0.25472*x);
@@ -34,16 +104,24 @@ double ran_gaussian() {
 	return v / u;
 }
 
-double ran_gaussian(double mean, double stdev) {
-	if ((stdev == 0.0) || (isnan(stdev))) {
+double Random::gaussian(double mean, double stdev) {
+	if ((stdev == 0.0) || (std::isnan(stdev))) {
 		return mean;
 	} else {
-		return mean + stdev*ran_gaussian();
+		return mean + stdev*gaussian();
 	}
 }
 
+double ran_gaussian() {
+	return ran_global().gaussian();
+}
+
+double ran_gaussian(double mean, double stdev) {
+	return ran_global().gaussian(mean, stdev);
+}
+
 double ran_uniform() {
-	return rand()/((double)RAND_MAX + 1);
+	return ran_global().uniform();
 }
 
 double ran_exp() {
@@ -51,4 +129,55 @@ double ran_exp() {
 }
 
 
+// Walker's alias method (Vose's construction): draws index i with probability weight[i] / sum(weight) in O(1)
+class AliasTable {
+	private:
+		std::vector<double> probability;
+		std::vector<int> alias;
+	public:
+		int size() const { return probability.size(); }
+
+		void build(const std::vector<double>& weight) {
+			int n = weight.size();
+			probability.assign(n, 1.0);
+			alias.resize(n);
+			double sum = 0;
+			for (int i = 0; i < n; i++) {
+				sum += weight[i];
+				alias[i] = i;
+			}
+			if (sum <= 0) {
+				return;
+			}
+			std::vector<int> small, large;
+			std::vector<double> scaled(n);
+			for (int i = 0; i < n; i++) {
+				scaled[i] = weight[i] * n / sum;
+				if (scaled[i] < 1.0) {
+					small.push_back(i);
+				} else {
+					large.push_back(i);
+				}
+			}
+			while (! small.empty() && ! large.empty()) {
+				int s = small.back();
+				int l = large.back();
+				small.pop_back();
+				probability[s] = scaled[s];
+				alias[s] = l;
+				scaled[l] -= 1.0 - scaled[s];
+				if (scaled[l] < 1.0) {
+					large.pop_back();
+					small.push_back(l);
+				}
+			}
+			// whatever is left is 1 up to rounding
+		}
+
+		inline int draw(Random& rng) const {
+			int i = rng.bounded(probability.size());
+			return (rng.uniform() < probability[i]) ? i : alias[i];
+		}
+};
+
 #endif /*RANDOM_H_*/
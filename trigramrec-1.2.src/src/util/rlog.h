@@ -12,7 +12,14 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <math.h>
 #include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// one line per newLine() with the fields in the order of addField: tab separated
+// with a header line (missing values NaN are written as NA), or one JSON object per line
 
 class RLog {
 	private:
@@ -20,9 +27,27 @@ class RLog {
 		std::vector<std::string> header;
 		std::map<std::string,double> default_value;
 		std::map<std::string,double> value;
+		std::map<std::string,std::string> text_value;
+		bool json;
+
+		void writeValue(const std::string& field) {
+			std::map<std::string,std::string>::const_iterator text = text_value.find(field);
+			if (text != text_value.end()) {
+				if (json) {
+					*out << "\"" << text->second << "\"";
+				} else {
+					*out << text->second;
+				}
+			} else if (isnan(value[field])) {
+				*out << (json ? "null" : "NA");
+			} else {
+				*out << value[field];
+			}
+		}
 	public:
-		RLog(std::ostream* stream) { 
+		RLog(std::ostream* stream, bool p_json = false) { 
 			out = stream;
+			json = p_json;
 			header.clear();
 			default_value.clear();
 			value.clear();
@@ -31,9 +56,13 @@ class RLog {
 		void log(const std::string& field, double d) {
 			value[field] = d;
 		}
+
+		void log(const std::string& field, const std::string& s) {
+			text_value[field] = s;
+		}
 		
 		void init() {
-			if (out != NULL) {
+			if ((out != NULL) && ! json) {
 				for (uint i = 0; i < header.size(); i++) {
 					*out << header[i];
 					if (i < (header.size()-1)) {
@@ -59,16 +88,23 @@ class RLog {
 		
 		void newLine() {
 			if (out != NULL) {
+				if (json) {
+					*out << "{";
+				}
 				for (uint i = 0; i < header.size(); i++) {
-					*out << value[header[i]];
+					if (json) {
+						*out << "\"" << header[i] << "\": ";
+					}
+					writeValue(header[i]);
 					if (i < (header.size()-1)) {
-						*out << "\t";
+						*out << (json ? ", " : "\t");
 					} else {
-						*out << "\n";
+						*out << (json ? "}\n" : "\n");
 					}
 				}
 				out->flush();
 				value.clear();	
+				text_value.clear();
 				for (uint i = 0; i < header.size(); i++) {
 					value[header[i]] = default_value[header[i]];	
 				}
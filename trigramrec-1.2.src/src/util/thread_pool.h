@@ -0,0 +1,120 @@
+/*
+	Persistent pool of worker threads
+
+	A ThreadPool keeps num_threads-1 workers alive; run() executes a task once
+	on every thread (the calling thread takes index 0) and blocks until all
+	copies have finished. Exceptions thrown by a task are rethrown by run().
+*/
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include "util.h"
+
+class ThreadPool {
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable cv_start;
+		std::condition_variable cv_done;
+		const std::function<void(int)>* task;
+		unsigned long long generation;
+		int num_running;
+		bool is_stopping;
+		std::exception_ptr error;
+
+		void execute(int thread_id) {
+			try {
+				(*task)(thread_id);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (! error) {
+					error = std::current_exception();
+				}
+			}
+		}
+
+		void workerLoop(int thread_id) {
+			unsigned long long seen_generation = 0;
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv_start.wait(lock, [&] { return is_stopping || (generation != seen_generation); });
+					if (is_stopping) {
+						return;
+					}
+					seen_generation = generation;
+				}
+				execute(thread_id);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					num_running--;
+				}
+				cv_done.notify_one();
+			}
+		}
+
+	public:
+		int num_threads;
+
+		ThreadPool(int p_num_threads) {
+			num_threads = std::max(p_num_threads, 1);
+			task = NULL;
+			generation = 0;
+			num_running = 0;
+			is_stopping = false;
+			for (int i = 1; i < num_threads; i++) {
+				workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+			}
+		}
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				is_stopping = true;
+			}
+			cv_start.notify_all();
+			for (uint i = 0; i < workers.size(); i++) {
+				workers[i].join();
+			}
+		}
+
+		// runs task(thread_id) for thread_id = 0..num_threads-1 and waits for all of them
+		void run(const std::function<void(int)>& p_task) {
+			if (num_threads == 1) {
+				p_task(0);
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				task = &p_task;
+				error = NULL;
+				num_running = num_threads - 1;
+				generation++;
+			}
+			cv_start.notify_all();
+			execute(0);
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_done.wait(lock, [&] { return num_running == 0; });
+			task = NULL;
+			if (error) {
+				std::exception_ptr e = error;
+				error = NULL;
+				std::rethrow_exception(e);
+			}
+		}
+
+		// splits [0, n) into num_threads contiguous ranges; thread i processes [begin(n,i), begin(n,i+1))
+		long long rangeBegin(long long n, int thread_id) const {
+			return n * thread_id / num_threads;
+		}
+};
+
+#endif /*THREAD_POOL_H_*/
@@ -13,6 +13,7 @@
 #include <vector>
 #include <ctime>
 #include <sys/resource.h>
+#include <sys/time.h>
 
 typedef unsigned int uint;
 
@@ -40,4 +41,24 @@ double getusertime() {
 	return (double)tim.tv_sec + (double)tim.tv_usec / 1000000.0; 
 }   
 
+// user + system time of all threads of the process
+double getcputime() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+// peak resident set size of the process in MB
+double getpeakrss() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)ru.ru_maxrss / 1024.0;
+}
+
+double getwalltime() {
+	struct timeval tim;
+	gettimeofday(&tim, NULL);
+	return (double)tim.tv_sec + (double)tim.tv_usec / 1000000.0;
+}
+
 #endif /*UTIL_H_*/